@@ -3,18 +3,37 @@ local config = require("config"):new("nyaa", {
     page_size = 10
 })
 
-ui.init()
-ui.set_cursor_type(0)
-
 local nyaa = {}
 
-function nyaa.search(title, page)
-    local response = requests.get({
-        url = "https://nyaa.land/?f=0&c=1_2&p=" .. tostring(page) .. "&q=" .. (requests.url_encode(title) or "")
+-- Only nyaa's own pages, the rest of the process keeps its transport settings.
+local function fetch(url)
+    return html.fetch({
+        url = url,
+        compression = true,
+        http2 = true
     })
+end
+
+local title_xpath = html.compile("./a[not(@class=\"comments\")]")
+
+local torrent_fields = {
+    full_title = { index = 2, xpath = title_xpath, attr = "title" },
+    link = { index = 2, xpath = title_xpath, attr = "href" },
+    comments = { index = 2, xpath = "./a[@class=\"comments\"]", type = "number" },
+    status = { attr = "class" },
+    torrent = { index = 3, xpath = "./a[1]", attr = "href" },
+    magnet = { index = 3, xpath = "./a[2]", attr = "href" },
+    size = { index = 4 },
+    timestamp = { index = 5, attr = "data-timestamp", type = "timestamp" },
+    time_title = { index = 5, attr = "title" },
+    date = { index = 5 },
+    seeders = { index = 6, type = "number" },
+    leechers = { index = 7, type = "number" },
+    total_downloads = { index = 8, type = "number" }
+}
 
-    local parser = html.parse(response.data)
-    local torrent_elms = parser:xpath("//tbody")[1]
+function nyaa.search(title, page)
+    local parser = fetch("https://nyaa.land/?f=0&c=1_2&p=" .. tostring(page) .. "&q=" .. (requests.url_encode(title) or ""))
     local amount = parser:xpath("//div[@class=\"pagination-page-info\"]")[1].text:match("out of (%d+) results.")
     local max_page = parser:xpath("//ul[@class=\"pagination\"]/li[not(@class=\"next\") and not(contains(@class, \"disabled\"))][last()]")
     
@@ -24,43 +43,24 @@ function nyaa.search(title, page)
         max_page = 1
     end
     
-    local torrents = {}
-
-    for _, elm in next, torrent_elms.children do
-        local title_elm = elm:xpath(".//td[@colspan=\"2\"]/a[not(@class=\"comments\")]")[1]
-        local comments_elm = elm:xpath(".//td[@colspan=\"2\"]/a[@class=\"comments\"]")[1]
-        local comments = 0
-
-        if comments_elm then
-            comments = tonumber(comments_elm.text:match("(%d+)"))
-        end
-
-        local full_title = title_elm.attributes.title
-        local download_elm = elm.children[3]
-        local time_elm = elm.children[5]
-
-        local torrent = {
-            full_title = full_title,
-            link = "https://nyaa.land" .. title_elm.attributes.href,
-            uploader = full_title:match("^%[(%w+)%]"),
-            status = elm.attributes.class,
-            size = elm.children[4].text,
-            magnet = download_elm.children[2].attributes.href,
-            torrent = download_elm.children[1].attributes.href,
-            time = {
-                timestamp = tonumber(time_elm.attributes["data-timestamp"]),
-                title = time_elm.attributes.title,
-                date = time_elm.text
-            },
-            comments = tonumber(comments),
-            seeders = tonumber(elm.children[6].text),
-            leechers = tonumber(elm.children[7].text),
-            total_downloads = tonumber(elm.children[7].text)
+    local torrents = parser:extract("//tbody/tr", torrent_fields)
+
+    for _, torrent in next, torrents do
+        torrent.link = "https://nyaa.land" .. torrent.link
+        torrent.uploader = torrent.full_title:match("^%[(%w+)%]")
+        torrent.comments = torrent.comments or 0
+        torrent.time = {
+            timestamp = torrent.timestamp,
+            title = torrent.time_title,
+            date = torrent.date
         }
-
-        table.insert(torrents, torrent)
+        torrent.timestamp = nil
+        torrent.time_title = nil
+        torrent.date = nil
     end
 
+    parser:close()
+
     return torrents, tonumber(amount), tonumber(max_page)
 end
 
@@ -151,8 +151,7 @@ function nyaa.get_torrent(title, page)
             return
         end
 
-        local c_response = requests.get({url = torrent.link})
-        local parser = html.parse(c_response.data)
+        local parser = fetch(torrent.link)
 
         local panels = parser:xpath("//div[@class=\"panel-body\"]")
         local line = 1
@@ -214,6 +213,8 @@ function nyaa.get_torrent(title, page)
             ::continue::
         end
 
+        parser:close()
+
         comments_window = ui.create({
             width = ui.cols,
             height = ui.rows
@@ -419,6 +420,9 @@ function nyaa.get_torrent(title, page)
 end
 
 local function download(title)
+    ui.init()
+    ui.set_cursor_type(0)
+
     print(string.format("Searching for %s..", title))
 
     local torrent = nyaa.get_torrent(title, 1)
@@ -433,5 +437,19 @@ return {
     description = "Scrapes from https://nyaa.land then uses qbittorent to download.",
     version = "0.0.1",
     type = "torrent",
-    download = download
+    download = download,
+
+    -- Used by multi-core searches, which run without the UI on their own thread.
+    search = function(title)
+        local torrents = nyaa.search(title, 1)
+
+        for _, torrent in next, torrents do
+            torrent.title = torrent.full_title
+        end
+
+        return torrents
+    end,
+    download_result = function(torrent)
+        qbit.download_magnet(torrent.magnet)
+    end
 }
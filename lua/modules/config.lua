@@ -2,76 +2,14 @@ local module = {
     configs = {}
 }
 
+-- Configs are stored natively; setting a value marks it for writing and the
+-- file is replaced atomically on config:commit(), at most once a second while
+-- values keep changing, and when the program exits.
 function module:new(name, default_config)
     if self.configs[name] then return self.configs[name] end
 
-    local config = setmetatable({
-        __default = default_config or {},
-        __config = {},
-        __config_path = string.format("%s/%s.json", system_paths.configs, name)
-    }, {
-        __index = function(this, index)
-            local val = rawget(this, index)
-            if type(val) == "function" then
-                return val
-            end
-
-            return rawget(this, "__config")[index]
-        end,
-        __newindex = function(this, index, value)
-            if type(value) == "function" then
-                rawset(this, index, value)
-                return
-            end
-            local config = rawget(this, "__config")
-
-            config[index] = value
-
-            local file = io.open(rawget(this, "__config_path"), "w")
-            assert(file, "Failed to open config.")
-            file:write(json.decode(config))
-            file:close()
-        end
-    })
-
-    function config.update_config(tbl, depth)
-        local default_cfg = rawget(config, "__default")
-        depth = depth or default_cfg
-
-        for key, value in next, depth do
-            if not tbl[key] then
-                tbl[key] = value
-            end
-
-            if type(value) == "table" then
-                tbl[key] = config.update_config(tbl[key], value)
-            end
-        end
-
-        return tbl
-    end
-
-    function config.set_default(cfg)
-        rawset(config, "__default", cfg)
-    end
-
-    local config_path = rawget(config, "__config_path")
-
-    local file = io.open(config_path, "r")
-    if file then
-        local text = file:read("*a")
-        file:close()
-
-        rawset(config, "__config", config.update_config(json.decode(text)))
-    else
-        file = io.open(config_path, "w")
-        assert(file, "Failed to open " .. config_path)
-
-        local cfg = rawget(config, "__default")
-        file:write(json.encode(cfg))
-        file:close()
-        rawset(config, "__config", cfg)
-    end
+    local config_path = string.format("%s/%s.json", system_paths.configs, name)
+    local config = configs.open(config_path, default_config or {})
 
     self.configs[name] = config
 
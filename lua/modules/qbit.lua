@@ -6,20 +6,15 @@ local config = require("config"):new("qbit", {
     api_url = "http://localhost:8080/api/v2",
     download_dir = system_paths.home .. "/Anime/Series"
 })
-local module = {
-    cookie = nil,
-}
+local module = {}
 
 function module.authenticate()
-    if module.cookie then
-        return module.cookie
-    end
-
     local login = config.login
 
     local response = requests.post({
         url = config.api_url .. "/auth/login",
         body = "username=" .. login.username .. "&password=" .. login.password,
+        cookies = "qbit",
         headers = {
             ["Content-Type"] = "application/x-www-form-urlencoded"
         }
@@ -27,25 +22,28 @@ function module.authenticate()
 
     if response.status_code ~= 200 then
         print("Failed to authenticate: " .. response.data)
-        return
+        return false
     end
 
-    module.cookie = response.headers["set-cookie"]
+    return true
 end
 
 function module.request(data)
-    if module.cookie == nil then
-        module.authenticate()
-    end
-
     data.url = config.api_url .. "/" .. data.endpoint
     data.endpoint = nil
+    data.cookies = "qbit"
     if not data.headers then
         data.headers = {}
     end
-    data.headers.Cookie = module.cookie
 
-    return requests.make(data)
+    local response = requests.make(data)
+
+    -- The session is kept in the cookie jar between runs, so only log in again once it has expired.
+    if response.status_code == 403 and module.authenticate() then
+        response = requests.make(data)
+    end
+
+    return response
 end
 
 function module.get(endpoint)
@@ -0,0 +1,192 @@
+#include <cstdio>
+#include <cinttypes>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <sys/stat.h>
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+}
+
+#include "bytecode.h"
+
+#define BYTECODE_FILE_MAGIC "ANIBYTECODE 1"
+
+std::string bytecode_dir;
+std::mutex bytecode_mutex;
+
+std::string bytecode_file_path(const std::string& path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(unsigned char c : path) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".luac", hash);
+
+    return bytecode_dir + "/" + name;
+}
+
+// The chunk is only reused while the source keeps its path, modification
+// time and size, and the interpreter is the same Lua release.
+bool source_key(const char* path, std::string& key) {
+    struct stat info;
+    if(stat(path, &info) != 0)
+        return false;
+
+    char stamp[96];
+    snprintf(stamp, sizeof(stamp), "%lld.%09ld %lld %s",
+        (long long) info.st_mtim.tv_sec, (long) info.st_mtim.tv_nsec, (long long) info.st_size, LUA_RELEASE);
+
+    key = std::string(path) + '\n' + stamp;
+    return true;
+}
+
+bool bytecode_read(const std::string& key, const std::string& file_path, std::string& chunk) {
+    std::ifstream file(file_path, std::ios::binary);
+    if(!file)
+        return false;
+
+    std::string magic, path, stamp;
+    size_t size = 0;
+
+    if(!std::getline(file, magic) || magic != BYTECODE_FILE_MAGIC)
+        return false;
+
+    std::getline(file, path);
+    std::getline(file, stamp);
+    file >> size;
+    file.get();
+
+    if(!file || path + '\n' + stamp != key)
+        return false;
+
+    chunk.resize(size);
+    file.read(chunk.data(), size);
+
+    return (bool) file;
+}
+
+void bytecode_write(const std::string& key, const std::string& file_path, const std::string& chunk) {
+    std::error_code error;
+    std::filesystem::create_directories(bytecode_dir, error);
+
+    std::string temp_path = file_path + ".tmp";
+
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if(!file)
+            return;
+
+        file << BYTECODE_FILE_MAGIC << '\n'
+             << key << '\n'
+             << chunk.size() << '\n';
+        file.write(chunk.data(), chunk.size());
+
+        if(!file) {
+            file.close();
+            std::filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+
+    std::filesystem::rename(temp_path, file_path, error);
+}
+
+int dump_writer(lua_State*, const void* data, size_t size, void* chunk) {
+    ((std::string*) chunk)->append((const char*) data, size);
+    return 0;
+}
+
+// Loads a chunk from the bytecode cache, falling back to the source when the
+// cached chunk is missing or stale. Same results as luaL_loadfile.
+bool load_cached(lua_State* L, const char* path, int& status) {
+    std::string key;
+    if(bytecode_dir.empty() || !source_key(path, key))
+        return false;
+
+    std::string file_path = bytecode_file_path(key.substr(0, key.find('\n')));
+    std::string chunk;
+    std::string name = std::string("@") + path;
+
+    bool cached;
+    {
+        std::lock_guard<std::mutex> lock(bytecode_mutex);
+        cached = bytecode_read(key, file_path, chunk);
+    }
+
+    if(cached && luaL_loadbufferx(L, chunk.data(), chunk.size(), name.c_str(), "b") == LUA_OK) {
+        status = LUA_OK;
+        return true;
+    }
+
+    if(cached)
+        lua_pop(L, 1);
+
+    status = luaL_loadfilex(L, path, "t");
+    if(status != LUA_OK)
+        return true;
+
+    chunk.clear();
+    if(lua_dump(L, dump_writer, &chunk, 0) == 0) {
+        std::lock_guard<std::mutex> lock(bytecode_mutex);
+        bytecode_write(key, file_path, chunk);
+    }
+
+    return true;
+}
+
+void bytecode_set_dir(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(bytecode_mutex);
+    bytecode_dir = dir;
+}
+
+int bytecode_load_file(lua_State* L, const char* path) {
+    int status;
+    if(load_cached(L, path, status))
+        return status;
+
+    return luaL_loadfile(L, path);
+}
+
+// Resolves modules through package.path like the default Lua searcher, but
+// loads them with bytecode_load_file.
+int lua_bytecode_searcher(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+    lua_pushstring(L, name);
+    lua_getfield(L, -3, "path");
+    lua_call(L, 2, 2);
+
+    if(lua_isnil(L, -2))
+        return 1;
+
+    const char* path = lua_tostring(L, -2);
+    if(bytecode_load_file(L, path) != LUA_OK)
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, path, lua_tostring(L, -1));
+
+    lua_pushstring(L, path);
+    return 2;
+}
+
+void bytecode_add_searcher(lua_State* L) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+
+    lua_Integer count = luaL_len(L, -1);
+    for(lua_Integer i = count; i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushcfunction(L, lua_bytecode_searcher);
+    lua_rawseti(L, -2, 2);
+
+    lua_pop(L, 2);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+extern "C" {
+    #include <lua.h>
+}
+
+void bytecode_set_dir(const std::string& dir);
+int bytecode_load_file(lua_State* L, const char* path);
+void bytecode_add_searcher(lua_State* L);
@@ -0,0 +1,181 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <list>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+
+#include "cache.h"
+
+#define CACHE_MEMORY_LIMIT (8 * 1024 * 1024)
+#define CACHE_FILE_MAGIC "ANICACHE 1"
+
+CacheStats cache_stats;
+
+std::string cache_dir;
+std::mutex cache_mutex;
+
+std::list<CacheEntry> lru;
+std::unordered_map<std::string, std::list<CacheEntry>::iterator> lru_index;
+size_t lru_size = 0;
+
+size_t entry_size(const CacheEntry& entry) {
+    return entry.key.size() + entry.header_data.size() + entry.body.size();
+}
+
+std::string cache_file_path(const std::string& key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(unsigned char c : key) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".cache", hash);
+
+    return cache_dir + "/" + name;
+}
+
+void memory_store(const CacheEntry& entry) {
+    auto found = lru_index.find(entry.key);
+    if(found != lru_index.end()) {
+        lru_size -= entry_size(*found->second);
+        lru.erase(found->second);
+        lru_index.erase(found);
+    }
+
+    if(entry_size(entry) > CACHE_MEMORY_LIMIT)
+        return;
+
+    lru.push_front(entry);
+    lru_index[entry.key] = lru.begin();
+    lru_size += entry_size(entry);
+
+    while(lru_size > CACHE_MEMORY_LIMIT && !lru.empty()) {
+        lru_size -= entry_size(lru.back());
+        lru_index.erase(lru.back().key);
+        lru.pop_back();
+    }
+}
+
+bool disk_load(const std::string& key, CacheEntry& entry) {
+    if(cache_dir.empty())
+        return false;
+
+    std::ifstream file(cache_file_path(key), std::ios::binary);
+    if(!file)
+        return false;
+
+    std::string magic;
+    if(!std::getline(file, magic) || magic != CACHE_FILE_MAGIC)
+        return false;
+
+    std::string expires;
+    size_t header_size = 0;
+    size_t body_size = 0;
+
+    std::getline(file, entry.key);
+    std::getline(file, expires);
+    std::getline(file, entry.etag);
+    std::getline(file, entry.last_modified);
+    std::getline(file, entry.vary);
+    std::getline(file, entry.vary_values);
+    file >> header_size >> body_size;
+    file.get();
+
+    if(!file || entry.key != key)
+        return false;
+
+    entry.expires = strtoll(expires.c_str(), nullptr, 10);
+    entry.header_data.resize(header_size);
+    entry.body.resize(body_size);
+    file.read(entry.header_data.data(), header_size);
+    file.read(entry.body.data(), body_size);
+
+    return (bool) file;
+}
+
+void disk_store(const CacheEntry& entry) {
+    if(cache_dir.empty())
+        return;
+
+    std::error_code error;
+    std::filesystem::create_directories(cache_dir, error);
+
+    std::string path = cache_file_path(entry.key);
+    std::string temp_path = path + ".tmp";
+
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if(!file)
+            return;
+
+        file << CACHE_FILE_MAGIC << '\n'
+             << entry.key << '\n'
+             << entry.expires << '\n'
+             << entry.etag << '\n'
+             << entry.last_modified << '\n'
+             << entry.vary << '\n'
+             << entry.vary_values << '\n'
+             << entry.header_data.size() << ' ' << entry.body.size() << '\n';
+        file.write(entry.header_data.data(), entry.header_data.size());
+        file.write(entry.body.data(), entry.body.size());
+
+        if(!file) {
+            file.close();
+            std::filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+
+    std::filesystem::rename(temp_path, path, error);
+}
+
+void cache_set_dir(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache_dir = dir;
+}
+
+bool cache_lookup(const std::string& key, CacheEntry& entry) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto found = lru_index.find(key);
+    if(found != lru_index.end()) {
+        lru.splice(lru.begin(), lru, found->second);
+        entry = *found->second;
+        return true;
+    }
+
+    if(!disk_load(key, entry))
+        return false;
+
+    memory_store(entry);
+    return true;
+}
+
+void cache_store(const CacheEntry& entry) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    memory_store(entry);
+    disk_store(entry);
+}
+
+void cache_clear() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    lru.clear();
+    lru_index.clear();
+    lru_size = 0;
+
+    if(cache_dir.empty())
+        return;
+
+    std::error_code error;
+    for(const auto& file : std::filesystem::directory_iterator(cache_dir, error)) {
+        if(file.path().extension() == ".cache")
+            std::filesystem::remove(file.path(), error);
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+typedef struct CacheEntry {
+    std::string key;
+    std::string vary;
+    std::string vary_values;
+    std::string etag;
+    std::string last_modified;
+    long long expires = 0;
+    std::string header_data;
+    std::string body;
+} CacheEntry;
+
+typedef struct CacheStats {
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+    std::atomic<size_t> revalidations{0};
+} CacheStats;
+
+void cache_set_dir(const std::string& dir);
+bool cache_lookup(const std::string& key, CacheEntry& entry);
+void cache_store(const CacheEntry& entry);
+void cache_clear();
+
+extern CacheStats cache_stats;
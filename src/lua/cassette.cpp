@@ -0,0 +1,91 @@
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "cassette.h"
+
+// Version 2 stores the URL with a length prefix like the header and body,
+// so URLs containing spaces can't break the entries after them.
+#define CASSETTE_MAGIC "ANICASSETTE 2"
+
+std::string cassette_hash(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    char result[17];
+    snprintf(result, sizeof(result), "%016" PRIx64, hash);
+
+    return result;
+}
+
+bool cassette_load(const std::string& path, std::vector<CassetteEntry>& entries) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file)
+        return false;
+
+    std::string magic;
+    if(!std::getline(file, magic) || magic != CASSETTE_MAGIC)
+        return false;
+
+    while(file.peek() != EOF) {
+        CassetteEntry entry;
+        size_t url_size = 0;
+        size_t header_size = 0;
+        size_t body_size = 0;
+
+        file >> entry.method >> entry.body_hash >> url_size >> header_size >> body_size;
+        file.get();
+
+        if(!file)
+            return false;
+
+        entry.url.resize(url_size);
+        entry.header_data.resize(header_size);
+        entry.body.resize(body_size);
+        file.read(entry.url.data(), url_size);
+        file.read(entry.header_data.data(), header_size);
+        file.read(entry.body.data(), body_size);
+        file.get();
+
+        if(!file)
+            return false;
+
+        entries.push_back(std::move(entry));
+    }
+
+    return true;
+}
+
+bool cassette_append(const std::string& path, const CassetteEntry& entry) {
+    std::ifstream existing(path, std::ios::binary);
+    bool exists = existing.good();
+
+    // Never mix entries of another version into an existing cassette.
+    std::string magic;
+    if(exists && std::getline(existing, magic) && magic != CASSETTE_MAGIC)
+        return false;
+
+    std::ofstream file(path, std::ios::binary | std::ios::app);
+    if(!file)
+        return false;
+
+    if(!exists)
+        file << CASSETTE_MAGIC << '\n';
+
+    file << entry.method << ' '
+         << entry.body_hash << ' '
+         << entry.url.size() << ' '
+         << entry.header_data.size() << ' '
+         << entry.body.size() << '\n';
+    file.write(entry.url.data(), entry.url.size());
+    file.write(entry.header_data.data(), entry.header_data.size());
+    file.write(entry.body.data(), entry.body.size());
+    file << '\n';
+
+    return (bool) file;
+}
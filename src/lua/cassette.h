@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+typedef struct CassetteEntry {
+    std::string method;
+    std::string url;
+    std::string body_hash;
+    std::string header_data;
+    std::string body;
+} CassetteEntry;
+
+std::string cassette_hash(const char* data, size_t size);
+bool cassette_load(const std::string& path, std::vector<CassetteEntry>& entries);
+bool cassette_append(const std::string& path, const CassetteEntry& entry);
@@ -0,0 +1,321 @@
+#include <new>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+}
+
+#include "config.h"
+#include "json.h"
+
+#define CONFIG_STORE "config.store"
+#define CONFIG_VALUES 1
+
+// Changes are written at most this often while values keep being set; the
+// rest are written by :commit() or when the store is collected.
+#define CONFIG_DEBOUNCE std::chrono::seconds(1)
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct ConfigStore {
+    std::string path;
+    std::string written;
+    bool dirty = false;
+    Clock::time_point changed;
+} ConfigStore;
+
+bool read_file(const std::string& path, std::string& data) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if(file == nullptr)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data.resize(size > 0 ? size : 0);
+    bool ok = fread(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+
+    return ok;
+}
+
+// Writes to a temporary file next to the config and renames it over the
+// old one, so a crash leaves either the old or the new file behind. The
+// temporary name is unique, since states on other threads may be writing
+// the same config.
+bool write_file_atomic(const std::string& path, const std::string& data) {
+    std::string temp = path + ".XXXXXX";
+
+    int fd = mkstemp(temp.data());
+    if(fd < 0)
+        return false;
+
+    // mkstemp creates the file as 0600, keep the mode the config had.
+    struct stat info;
+    fchmod(fd, stat(path.c_str(), &info) == 0 ? info.st_mode & 07777 : 0644);
+
+    FILE* file = fdopen(fd, "wb");
+    if(file == nullptr) {
+        close(fd);
+        remove(temp.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size()
+        && fflush(file) == 0
+        && fsync(fileno(file)) == 0;
+
+    ok = fclose(file) == 0 && ok;
+    if(ok && rename(temp.c_str(), path.c_str()) == 0)
+        return true;
+
+    remove(temp.c_str());
+    return false;
+}
+
+// Copies `defaults` into the table at `index` wherever a key is missing,
+// recursing into tables present on both sides. Tables are copied so the
+// defaults are never changed through the config.
+void merge_defaults(lua_State* L, int index, int defaults) {
+    index = lua_absindex(L, index);
+    defaults = lua_absindex(L, defaults);
+    luaL_checkstack(L, 4, "config is nested too deeply");
+
+    lua_pushnil(L);
+    while(lua_next(L, defaults) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, index);
+
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+
+            if(lua_istable(L, -1)) {
+                lua_newtable(L);
+                merge_defaults(L, -1, -2);
+                lua_replace(L, -2);
+            }
+
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, index);
+        } else {
+            if(lua_istable(L, -1) && lua_istable(L, -2))
+                merge_defaults(L, -1, -2);
+
+            lua_pop(L, 2);
+        }
+    }
+}
+
+bool encode_config(lua_State* L, int values) {
+    values = lua_absindex(L, values);
+
+    lua_createtable(L, 0, 3);
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "pretty");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "sort_keys");
+    lua_pushstring(L, "\t");
+    lua_setfield(L, -2, "indent");
+
+    bool ok = json_encode(L, values, lua_gettop(L));
+    lua_remove(L, -2);
+
+    return ok;
+}
+
+// Writes the store if its encoded values differ from what was last written,
+// which also catches changes made inside nested tables. Pushes an error
+// message and returns false on failure.
+bool commit_config(lua_State* L, int index) {
+    ConfigStore* store = (ConfigStore*) lua_touserdata(L, index);
+
+    // A store whose file failed to load has nothing to write.
+    if(lua_getiuservalue(L, index, CONFIG_VALUES) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return true;
+    }
+
+    bool ok = encode_config(L, -1);
+    lua_remove(L, -2);
+
+    if(!ok)
+        return false;
+
+    size_t size;
+    const char* data = lua_tolstring(L, -1, &size);
+
+    if(store->written.size() != size || memcmp(store->written.data(), data, size) != 0) {
+        if(!write_file_atomic(store->path, std::string(data, size))) {
+            lua_pop(L, 1);
+            lua_pushfstring(L, "Failed to write config: %s", store->path.c_str());
+            return false;
+        }
+
+        store->written.assign(data, size);
+    }
+
+    lua_pop(L, 1);
+    store->dirty = false;
+    return true;
+}
+
+ConfigStore* check_config(lua_State* L, int index) {
+    return (ConfigStore*) luaL_checkudata(L, index, CONFIG_STORE);
+}
+
+int lua_config_commit(lua_State* L) {
+    check_config(L, 1);
+
+    if(!commit_config(L, 1))
+        return lua_error(L);
+
+    return 0;
+}
+
+int lua_config_index(lua_State* L) {
+    check_config(L, 1);
+
+    if(lua_type(L, 2) == LUA_TSTRING && strcmp(lua_tostring(L, 2), "commit") == 0) {
+        lua_pushcfunction(L, lua_config_commit);
+        return 1;
+    }
+
+    lua_getiuservalue(L, 1, CONFIG_VALUES);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+
+    return 1;
+}
+
+int lua_config_newindex(lua_State* L) {
+    ConfigStore* store = check_config(L, 1);
+
+    lua_getiuservalue(L, 1, CONFIG_VALUES);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+
+    Clock::time_point now = Clock::now();
+    if(!store->dirty) {
+        store->dirty = true;
+        store->changed = now;
+    } else if(now - store->changed >= CONFIG_DEBOUNCE && !commit_config(L, 1)) {
+        return lua_error(L);
+    }
+
+    return 0;
+}
+
+int lua_config_pairs(lua_State* L) {
+    check_config(L, 1);
+
+    lua_getglobal(L, "next");
+    lua_getiuservalue(L, 1, CONFIG_VALUES);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+int lua_config_gc(lua_State* L) {
+    ConfigStore* store = check_config(L, 1);
+
+    if(!commit_config(L, 1)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    store->~ConfigStore();
+    return 0;
+}
+
+int lua_config_tostring(lua_State* L) {
+    ConfigStore* store = check_config(L, 1);
+
+    lua_pushfstring(L, "config (%s)", store->path.c_str());
+    return 1;
+}
+
+// Loads the file with a single read and fills in missing defaults, leaving
+// the values table on the stack. Writes the file straight away if it didn't
+// exist yet.
+bool load_config(lua_State* L, int index, int defaults) {
+    ConfigStore* store = (ConfigStore*) lua_touserdata(L, index);
+    std::string data;
+    bool exists = read_file(store->path, data);
+
+    if(exists) {
+        if(!json_decode(L, data.data(), data.size())) {
+            lua_pushfstring(L, "Failed to load config %s: %s", store->path.c_str(), lua_tostring(L, -1));
+            lua_remove(L, -2);
+            return false;
+        }
+
+        if(!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+        }
+
+        store->written = std::move(data);
+    } else {
+        lua_newtable(L);
+    }
+
+    if(lua_istable(L, defaults))
+        merge_defaults(L, -1, defaults);
+
+    lua_setiuservalue(L, index, CONFIG_VALUES);
+
+    return exists || commit_config(L, index);
+}
+
+int lua_config_open(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    if(!lua_isnoneornil(L, 2))
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+    ConfigStore* store = (ConfigStore*) lua_newuserdatauv(L, sizeof(ConfigStore), 1);
+    new (store) ConfigStore();
+    luaL_setmetatable(L, CONFIG_STORE);
+
+    store->path = path;
+    int index = lua_gettop(L);
+
+    // A store that failed to open holds no values, so its __gc doesn't try
+    // to write them again.
+    if(!load_config(L, index, 2)) {
+        lua_pushnil(L);
+        lua_setiuservalue(L, index, CONFIG_VALUES);
+        return lua_error(L);
+    }
+
+    return 1;
+}
+
+void load_config_library(lua_State* L) {
+    luaL_newmetatable(L, CONFIG_STORE);
+    lua_pushcfunction(L, lua_config_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_config_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, lua_config_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushcfunction(L, lua_config_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, lua_config_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lua_config_open);
+    lua_setfield(L, -2, "open");
+    lua_setglobal(L, "configs");
+}
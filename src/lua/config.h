@@ -0,0 +1,5 @@
+extern "C" {
+    #include <lua.h>
+}
+
+void load_config_library(lua_State* L);
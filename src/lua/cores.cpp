@@ -0,0 +1,344 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <json/json.h>
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include "cores.h"
+#include "bytecode.h"
+
+#define CORES_INDEX_VERSION 4
+#define SANDBOX_MEMORY_LIMIT (64 * 1024 * 1024)
+#define SANDBOX_INSTRUCTION_LIMIT 50000000
+#define SANDBOX_HOOK_INTERVAL 10000
+#define SANDBOX_STUB "core.stub"
+
+typedef struct Sandbox {
+    size_t memory = 0;
+    long instructions = 0;
+} Sandbox;
+
+// The index is only valid for a core file with the same modification time
+// and size.
+bool core_stamp(const std::string& path, std::string& stamp) {
+    struct stat info;
+    if(stat(path.c_str(), &info) != 0)
+        return false;
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%lld.%09ld %lld",
+        (long long) info.st_mtim.tv_sec, (long) info.st_mtim.tv_nsec, (long long) info.st_size);
+
+    stamp = buffer;
+    return true;
+}
+
+void* sandbox_alloc(void* data, void* block, size_t old_size, size_t new_size) {
+    Sandbox* sandbox = (Sandbox*) data;
+    if(block == nullptr)
+        old_size = 0;
+
+    if(new_size == 0) {
+        sandbox->memory -= old_size;
+        free(block);
+        return nullptr;
+    }
+
+    if(new_size > old_size && sandbox->memory + new_size - old_size > SANDBOX_MEMORY_LIMIT)
+        return nullptr;
+
+    void* result = realloc(block, new_size);
+    if(result != nullptr)
+        sandbox->memory = sandbox->memory + new_size - old_size;
+
+    return result;
+}
+
+void sandbox_hook(lua_State* L, lua_Debug*) {
+    Sandbox* sandbox;
+    lua_getallocf(L, (void**) &sandbox);
+
+    sandbox->instructions += SANDBOX_HOOK_INTERVAL;
+    if(sandbox->instructions > SANDBOX_INSTRUCTION_LIMIT)
+        luaL_error(L, "the core took too long to load");
+}
+
+// Stands in for every native library and module: any field of a stub, any
+// call to one and any arithmetic applied to one is another stub, so top-level
+// setup like ui.init(), require("config"):new(...).field or
+// system_paths.config .. "/x" does nothing. Comparisons are false, the
+// length is 0, and assignments and `<close>` are ignored.
+int lua_stub(lua_State* L) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    return 1;
+}
+
+int lua_stub_len(lua_State* L) {
+    lua_pushinteger(L, 0);
+    return 1;
+}
+
+int lua_stub_tostring(lua_State* L) {
+    lua_pushliteral(L, "stub");
+    return 1;
+}
+
+int lua_stub_compare(lua_State* L) {
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+int lua_stub_ignore(lua_State*) {
+    return 0;
+}
+
+const char* stub_operators[] = {
+    "__index", "__call", "__concat", "__unm", "__add", "__sub", "__mul", "__div", "__idiv", "__mod",
+    "__pow", "__band", "__bor", "__bxor", "__shl", "__shr", "__bnot",
+};
+
+void push_stub(lua_State* L) {
+    if(luaL_getmetatable(L, SANDBOX_STUB) == LUA_TTABLE) {
+        lua_getfield(L, -1, "stub");
+        lua_remove(L, -2);
+        return;
+    }
+
+    lua_pop(L, 1);
+    luaL_newmetatable(L, SANDBOX_STUB);
+
+    lua_newtable(L);
+    lua_pushvalue(L, -2);
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, lua_stub, 1);
+    for(const char* name : stub_operators) {
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -4, name);
+    }
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, lua_stub_len);
+    lua_setfield(L, -3, "__len");
+    lua_pushcfunction(L, lua_stub_tostring);
+    lua_setfield(L, -3, "__tostring");
+    lua_pushcfunction(L, lua_stub_compare);
+    lua_setfield(L, -3, "__lt");
+    lua_pushcfunction(L, lua_stub_compare);
+    lua_setfield(L, -3, "__le");
+    lua_pushcfunction(L, lua_stub_ignore);
+    lua_setfield(L, -3, "__newindex");
+    lua_pushcfunction(L, lua_stub_ignore);
+    lua_setfield(L, -3, "__close");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "stub");
+    lua_remove(L, -2);
+}
+
+int lua_sandbox_require(lua_State* L) {
+    push_stub(L);
+    return 1;
+}
+
+void open_sandbox(lua_State* L) {
+    const luaL_Reg libraries[] = {
+        {LUA_GNAME, luaopen_base},
+        {LUA_TABLIBNAME, luaopen_table},
+        {LUA_STRLIBNAME, luaopen_string},
+        {LUA_MATHLIBNAME, luaopen_math},
+        {LUA_UTF8LIBNAME, luaopen_utf8},
+    };
+
+    for(const luaL_Reg& library : libraries) {
+        luaL_requiref(L, library.name, library.func, 1);
+        lua_pop(L, 1);
+    }
+
+    const char* removed[] = {"dofile", "loadfile", "load", "collectgarbage"};
+    for(const char* name : removed) {
+        lua_pushnil(L);
+        lua_setglobal(L, name);
+    }
+
+    const char* stubs[] = {"ui", "requests", "html", "json", "configs", "system_paths", "os", "io", "package", "print"};
+    for(const char* name : stubs) {
+        push_stub(L);
+        lua_setglobal(L, name);
+    }
+
+    lua_pushcfunction(L, lua_sandbox_require);
+    lua_setglobal(L, "require");
+}
+
+void read_field(lua_State* L, int index, const char* field, std::string& value) {
+    lua_getfield(L, index, field);
+    if(lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER)
+        value = lua_tostring(L, -1);
+    lua_pop(L, 1);
+}
+
+// Runs the core's top level in a fresh state without the real libraries,
+// with memory and instruction limits, and reads the metadata fields of the
+// table it returns.
+void extract_core(const std::string& path, CoreInfo& core) {
+    Sandbox sandbox;
+    lua_State* L = lua_newstate(sandbox_alloc, &sandbox);
+    if(L == nullptr) {
+        core.error = "failed to allocate a Lua state";
+        return;
+    }
+
+    open_sandbox(L);
+    lua_sethook(L, sandbox_hook, LUA_MASKCOUNT, SANDBOX_HOOK_INTERVAL);
+
+    if(bytecode_load_file(L, path.c_str()) != LUA_OK || lua_pcall(L, 0, 1, 0) != LUA_OK) {
+        const char* error = lua_tostring(L, -1);
+        core.error = error != nullptr ? error : "unknown error";
+    } else if(!lua_istable(L, -1)) {
+        core.error = "the core didn't return a table";
+    } else {
+        read_field(L, -1, "name", core.name);
+        read_field(L, -1, "description", core.description);
+        read_field(L, -1, "version", core.version);
+        read_field(L, -1, "type", core.type);
+
+        lua_getfield(L, -1, "search");
+        core.searchable = lua_isfunction(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_close(L);
+}
+
+void load_index(const std::string& index_path, std::unordered_map<std::string, CoreInfo>& index) {
+    std::ifstream file(index_path);
+    if(!file)
+        return;
+
+    Json::Value root;
+    Json::CharReaderBuilder reader;
+    std::string errors;
+
+    if(!Json::parseFromStream(reader, file, &root, &errors) || root["version"].asInt() != CORES_INDEX_VERSION)
+        return;
+
+    for(const Json::Value& entry : root["cores"]) {
+        CoreInfo core;
+        core.file = entry["file"].asString();
+        core.stamp = entry["stamp"].asString();
+        core.name = entry["name"].asString();
+        core.description = entry["description"].asString();
+        core.version = entry["version"].asString();
+        core.type = entry["type"].asString();
+        core.error = entry["error"].asString();
+        core.searchable = entry["searchable"].asBool();
+
+        index[core.file] = core;
+    }
+}
+
+void save_index(const std::string& index_path, const std::vector<CoreInfo>& cores) {
+    Json::Value root;
+    root["version"] = CORES_INDEX_VERSION;
+    root["cores"] = Json::Value(Json::arrayValue);
+
+    for(const CoreInfo& core : cores) {
+        Json::Value entry;
+        entry["file"] = core.file;
+        entry["stamp"] = core.stamp;
+        entry["name"] = core.name;
+        entry["description"] = core.description;
+        entry["version"] = core.version;
+        entry["type"] = core.type;
+        entry["error"] = core.error;
+        entry["searchable"] = core.searchable;
+
+        root["cores"].append(entry);
+    }
+
+    std::string temp_path = index_path + ".tmp";
+    std::error_code error;
+
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        if(!file)
+            return;
+
+        Json::StreamWriterBuilder writer;
+        writer["indentation"] = "    ";
+        file << Json::writeString(writer, root);
+
+        if(!file) {
+            file.close();
+            std::filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+
+    std::filesystem::rename(temp_path, index_path, error);
+}
+
+// Lists the cores in `cores_dir`, sorted by file name. Only cores whose file
+// changed since the index was written are loaded again; the index is
+// rewritten when anything changed.
+bool cores_list(const std::string& cores_dir, const std::string& index_path, std::vector<CoreInfo>& cores) {
+    std::unordered_map<std::string, CoreInfo> index;
+    load_index(index_path, index);
+
+    std::error_code error;
+    std::filesystem::directory_iterator entries(cores_dir, error);
+    if(error)
+        return false;
+
+    bool changed = false;
+
+    for(const auto& entry : entries) {
+        std::filesystem::path path = entry.path();
+        std::string file = path.stem().string();
+
+        if(path.extension() != ".lua" || file.empty() || file[0] == '.')
+            continue;
+
+        CoreInfo core;
+        if(!core_stamp(path.string(), core.stamp))
+            continue;
+
+        auto found = index.find(file);
+        if(found != index.end() && found->second.stamp == core.stamp) {
+            cores.push_back(found->second);
+            continue;
+        }
+
+        core.file = file;
+        core.name = file;
+        extract_core(path.string(), core);
+
+        cores.push_back(core);
+        changed = true;
+    }
+
+    changed = changed || cores.size() != index.size();
+
+    std::sort(cores.begin(), cores.end(), [](const CoreInfo& a, const CoreInfo& b) {
+        return a.file < b.file;
+    });
+
+    if(changed)
+        save_index(index_path, cores);
+
+    return true;
+}
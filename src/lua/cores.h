@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+typedef struct CoreInfo {
+    std::string file;
+    std::string name;
+    std::string description;
+    std::string version;
+    std::string type;
+    std::string error;
+    std::string stamp;
+    bool searchable = false;
+} CoreInfo;
+
+bool cores_list(const std::string& cores_dir, const std::string& index_path, std::vector<CoreInfo>& cores);
@@ -1,202 +1,1395 @@
-#include <json/json.h>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <clocale>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
 
 extern "C" {
     #include <lua.h>
+    #include <lauxlib.h>
 }
 
-void json_to_lua_table(lua_State* L, Json::Value json) {
-    if (json.isObject()) {
-        lua_createtable(L, 0, json.size());
-        for (const auto& key : json.getMemberNames()) {
-            const Json::Value& value = json[key];
-
-            lua_pushstring(L, key.c_str());
-
-            if (value.isString()) {
-                lua_pushstring(L, value.asString().c_str());
-            } else if (value.isInt()) {
-                lua_pushinteger(L, value.asInt());
-            } else if (value.isDouble()) {
-                lua_pushnumber(L, value.asDouble());
-            } else if (value.isBool()) {
-                lua_pushboolean(L, value.asBool());
-            } else if (value.isObject() || value.isArray()) {
-                json_to_lua_table(L, value);
-            } else {
-                lua_pushnil(L);
-            }
+#include "json.h"
+
+#define JSON_MAX_DEPTH 256
+#define JSON_CHUNK 256
+#define JSON_ARRAY "json.array"
+#define JSON_OBJECT "json.object"
+
+typedef struct JsonDecoder {
+    lua_State* L;
+    const char* start;
+    const char* cur;
+    const char* end;
+    const char* error;
+    int depth;
+    std::string scratch;
+} JsonDecoder;
+
+bool decode_value(JsonDecoder& decoder);
+
+bool decode_fail(JsonDecoder& decoder, const char* error) {
+    decoder.error = error;
+    return false;
+}
+
+void skip_whitespace(JsonDecoder& decoder) {
+    while(decoder.cur < decoder.end) {
+        char c = *decoder.cur;
+        if(c != ' ' && c != '\n' && c != '\r' && c != '\t')
+            break;
+
+        decoder.cur++;
+    }
+}
+
+int hex_digit(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
 
-            lua_settable(L, -3);
+bool read_hex4(JsonDecoder& decoder, unsigned int& code) {
+    if(decoder.end - decoder.cur < 4)
+        return decode_fail(decoder, "truncated \\u escape");
+
+    code = 0;
+    for(int i = 0; i < 4; i++) {
+        int digit = hex_digit(decoder.cur[i]);
+        if(digit < 0)
+            return decode_fail(decoder, "invalid \\u escape");
+
+        code = code << 4 | digit;
+    }
+
+    decoder.cur += 4;
+    return true;
+}
+
+void append_utf8(std::string& out, unsigned int code) {
+    if(code < 0x80) {
+        out += (char) code;
+    } else if(code < 0x800) {
+        out += (char) (0xC0 | code >> 6);
+        out += (char) (0x80 | (code & 0x3F));
+    } else if(code < 0x10000) {
+        out += (char) (0xE0 | code >> 12);
+        out += (char) (0x80 | (code >> 6 & 0x3F));
+        out += (char) (0x80 | (code & 0x3F));
+    } else {
+        out += (char) (0xF0 | code >> 18);
+        out += (char) (0x80 | (code >> 12 & 0x3F));
+        out += (char) (0x80 | (code >> 6 & 0x3F));
+        out += (char) (0x80 | (code & 0x3F));
+    }
+}
+
+bool decode_escape(JsonDecoder& decoder, std::string& out) {
+    if(decoder.cur >= decoder.end)
+        return decode_fail(decoder, "unterminated string");
+
+    char c = *decoder.cur++;
+    switch(c) {
+        case '"': out += '"'; return true;
+        case '\\': out += '\\'; return true;
+        case '/': out += '/'; return true;
+        case 'b': out += '\b'; return true;
+        case 'f': out += '\f'; return true;
+        case 'n': out += '\n'; return true;
+        case 'r': out += '\r'; return true;
+        case 't': out += '\t'; return true;
+        case 'u': break;
+        default: return decode_fail(decoder, "invalid escape");
+    }
+
+    unsigned int code;
+    if(!read_hex4(decoder, code))
+        return false;
+
+    if(code >= 0xD800 && code <= 0xDBFF) {
+        unsigned int low;
+        if(decoder.end - decoder.cur < 2 || decoder.cur[0] != '\\' || decoder.cur[1] != 'u')
+            return decode_fail(decoder, "unpaired surrogate");
+
+        decoder.cur += 2;
+        if(!read_hex4(decoder, low))
+            return false;
+        if(low < 0xDC00 || low > 0xDFFF)
+            return decode_fail(decoder, "unpaired surrogate");
+
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    } else if(code >= 0xDC00 && code <= 0xDFFF) {
+        return decode_fail(decoder, "unpaired surrogate");
+    }
+
+    append_utf8(out, code);
+    return true;
+}
+
+// Strings without escapes are pushed straight from the input, the rest are
+// unescaped into a scratch buffer that is reused across the whole document.
+bool decode_string(JsonDecoder& decoder) {
+    const char* begin = ++decoder.cur;
+
+    while(decoder.cur < decoder.end) {
+        unsigned char c = *decoder.cur;
+
+        if(c == '"') {
+            lua_pushlstring(decoder.L, begin, decoder.cur - begin);
+            decoder.cur++;
+            return true;
+        }
+        if(c == '\\')
+            break;
+        if(c < 0x20)
+            return decode_fail(decoder, "control character in string");
+
+        decoder.cur++;
+    }
+
+    std::string& out = decoder.scratch;
+    out.assign(begin, decoder.cur - begin);
+
+    while(decoder.cur < decoder.end) {
+        unsigned char c = *decoder.cur++;
+
+        if(c == '"') {
+            lua_pushlstring(decoder.L, out.data(), out.size());
+            return true;
         }
-    } else if (json.isArray()) {
-        lua_createtable(L, json.size(), 0);
-        for (Json::ArrayIndex i = 0; i < json.size(); ++i) {
-            json_to_lua_table(L, json[i]);
-            lua_rawseti(L, -2, i + 1);
+
+        if(c == '\\') {
+            if(!decode_escape(decoder, out))
+                return false;
+        } else if(c < 0x20) {
+            decoder.cur--;
+            return decode_fail(decoder, "control character in string");
+        } else {
+            out += (char) c;
         }
-    } else {
-        lua_pushnil(L);
     }
+
+    return decode_fail(decoder, "unterminated string");
 }
 
-int is_array(lua_State* L, int index) {
-    if (!lua_istable(L, index)) {
-        return 0;
+bool skip_digits(JsonDecoder& decoder) {
+    const char* begin = decoder.cur;
+    while(decoder.cur < decoder.end && *decoder.cur >= '0' && *decoder.cur <= '9')
+        decoder.cur++;
+
+    return decoder.cur > begin;
+}
+
+// Skips a string while validating it, for the lazy index.
+bool scan_string(JsonDecoder& decoder, bool& escaped) {
+    escaped = false;
+    decoder.cur++;
+
+    while(decoder.cur < decoder.end) {
+        unsigned char c = *decoder.cur++;
+
+        if(c == '"')
+            return true;
+
+        if(c == '\\') {
+            escaped = true;
+            decoder.scratch.clear();
+            if(!decode_escape(decoder, decoder.scratch))
+                return false;
+        } else if(c < 0x20) {
+            decoder.cur--;
+            return decode_fail(decoder, "control character in string");
+        }
     }
 
-    size_t len = lua_rawlen(L, index);
-    if (len > 0) {
-        return 1;
+    return decode_fail(decoder, "unterminated string");
+}
+
+bool scan_number(JsonDecoder& decoder) {
+    if(*decoder.cur == '-')
+        decoder.cur++;
+
+    if(decoder.cur < decoder.end && *decoder.cur == '0')
+        decoder.cur++;
+    else if(!skip_digits(decoder))
+        return decode_fail(decoder, "invalid number");
+
+    if(decoder.cur < decoder.end && *decoder.cur == '.') {
+        decoder.cur++;
+        if(!skip_digits(decoder))
+            return decode_fail(decoder, "invalid number");
+    }
+
+    if(decoder.cur < decoder.end && (*decoder.cur == 'e' || *decoder.cur == 'E')) {
+        decoder.cur++;
+        if(decoder.cur < decoder.end && (*decoder.cur == '+' || *decoder.cur == '-'))
+            decoder.cur++;
+        if(!skip_digits(decoder))
+            return decode_fail(decoder, "invalid number");
+    }
+
+    return true;
+}
+
+// Validates the JSON grammar and lets Lua do the conversion, so integral
+// values stay lua_Integer (falling back to a float only on overflow) and
+// anything with a fraction or exponent becomes a float.
+bool decode_number(JsonDecoder& decoder) {
+    const char* begin = decoder.cur;
+    if(!scan_number(decoder))
+        return false;
+
+    char number[64];
+    size_t size = decoder.cur - begin;
+    if(size >= sizeof(number)) {
+        decoder.scratch.assign(begin, size);
+        if(lua_stringtonumber(decoder.L, decoder.scratch.c_str()) == 0)
+            return decode_fail(decoder, "invalid number");
+
+        return true;
+    }
+
+    memcpy(number, begin, size);
+    number[size] = '\0';
+
+    if(lua_stringtonumber(decoder.L, number) == 0)
+        return decode_fail(decoder, "invalid number");
+
+    return true;
+}
+
+bool decode_literal(JsonDecoder& decoder, const char* literal, size_t size) {
+    if((size_t) (decoder.end - decoder.cur) < size || memcmp(decoder.cur, literal, size) != 0)
+        return decode_fail(decoder, "unexpected character");
+
+    decoder.cur += size;
+    return true;
+}
+
+// Containers collect their values on the Lua stack and are moved into a
+// table sized for them, in chunks so huge arrays don't exhaust the stack.
+void flush_array(lua_State* L, int base, int& table, int pending, lua_Integer& count) {
+    if(table == 0) {
+        lua_createtable(L, pending, 0);
+        lua_insert(L, base + 1);
+        table = base + 1;
+    }
+
+    for(int i = pending; i > 0; i--)
+        lua_rawseti(L, table, count + i);
+
+    count += pending;
+}
+
+bool decode_array(JsonDecoder& decoder) {
+    lua_State* L = decoder.L;
+    int base = lua_gettop(L);
+    int table = 0;
+    int pending = 0;
+    lua_Integer count = 0;
+
+    decoder.cur++;
+    skip_whitespace(decoder);
+
+    if(decoder.cur < decoder.end && *decoder.cur == ']') {
+        decoder.cur++;
+        lua_createtable(L, 0, 0);
+        return true;
+    }
+
+    while(true) {
+        if(!lua_checkstack(L, 2))
+            return decode_fail(decoder, "document is too large");
+        if(!decode_value(decoder))
+            return false;
+
+        if(++pending == JSON_CHUNK) {
+            flush_array(L, base, table, pending, count);
+            pending = 0;
+        }
+
+        skip_whitespace(decoder);
+        if(decoder.cur >= decoder.end)
+            return decode_fail(decoder, "unterminated array");
+
+        char c = *decoder.cur++;
+        if(c == ']')
+            break;
+        if(c != ',')
+            return decode_fail(decoder, "expected ',' or ']'");
+
+        skip_whitespace(decoder);
+    }
+
+    if(pending > 0 || table == 0)
+        flush_array(L, base, table, pending, count);
+
+    return true;
+}
+
+// Pairs are stored in document order, so a duplicate key keeps its last
+// value like in json.lazy, and a later null removes an earlier value.
+void flush_object(lua_State* L, int base, int& table, int pending) {
+    if(table == 0) {
+        lua_createtable(L, 0, pending);
+        lua_insert(L, base + 1);
+        table = base + 1;
+    }
+
+    int first = lua_gettop(L) - pending * 2 + 1;
+    for(int i = 0; i < pending; i++) {
+        lua_pushvalue(L, first + i * 2);
+        lua_pushvalue(L, first + i * 2 + 1);
+        lua_rawset(L, table);
+    }
+
+    lua_settop(L, first - 1);
+}
+
+bool decode_object(JsonDecoder& decoder) {
+    lua_State* L = decoder.L;
+    int base = lua_gettop(L);
+    int table = 0;
+    int pending = 0;
+
+    decoder.cur++;
+    skip_whitespace(decoder);
+
+    if(decoder.cur < decoder.end && *decoder.cur == '}') {
+        decoder.cur++;
+        lua_createtable(L, 0, 0);
+        luaL_setmetatable(L, JSON_OBJECT);
+        return true;
+    }
+
+    while(true) {
+        if(decoder.cur >= decoder.end || *decoder.cur != '"')
+            return decode_fail(decoder, "expected a string key");
+        if(!lua_checkstack(L, 5))
+            return decode_fail(decoder, "document is too large");
+        if(!decode_string(decoder))
+            return false;
+
+        skip_whitespace(decoder);
+        if(decoder.cur >= decoder.end || *decoder.cur != ':')
+            return decode_fail(decoder, "expected ':'");
+
+        decoder.cur++;
+        if(!decode_value(decoder))
+            return false;
+
+        if(++pending == JSON_CHUNK) {
+            flush_object(L, base, table, pending);
+            pending = 0;
+        }
+
+        skip_whitespace(decoder);
+        if(decoder.cur >= decoder.end)
+            return decode_fail(decoder, "unterminated object");
+
+        char c = *decoder.cur++;
+        if(c == '}')
+            break;
+        if(c != ',')
+            return decode_fail(decoder, "expected ',' or '}'");
+
+        skip_whitespace(decoder);
+    }
+
+    if(pending > 0 || table == 0)
+        flush_object(L, base, table, pending);
+
+    // Every object is marked, so one that loses its keys in Lua is still
+    // encoded as {} instead of [].
+    luaL_setmetatable(L, JSON_OBJECT);
+    return true;
+}
+
+bool decode_value(JsonDecoder& decoder) {
+    skip_whitespace(decoder);
+    if(decoder.cur >= decoder.end)
+        return decode_fail(decoder, "unexpected end of input");
+
+    switch(*decoder.cur) {
+        case '{':
+        case '[': {
+            if(++decoder.depth > JSON_MAX_DEPTH)
+                return decode_fail(decoder, "nesting is too deep");
+
+            bool ok = *decoder.cur == '{' ? decode_object(decoder) : decode_array(decoder);
+            decoder.depth--;
+            return ok;
+        }
+        case '"':
+            return decode_string(decoder);
+        case 't':
+            if(!decode_literal(decoder, "true", 4))
+                return false;
+            lua_pushboolean(decoder.L, 1);
+            return true;
+        case 'f':
+            if(!decode_literal(decoder, "false", 5))
+                return false;
+            lua_pushboolean(decoder.L, 0);
+            return true;
+        case 'n':
+            if(!decode_literal(decoder, "null", 4))
+                return false;
+            lua_pushnil(decoder.L);
+            return true;
+        default:
+            if(*decoder.cur == '-' || (*decoder.cur >= '0' && *decoder.cur <= '9'))
+                return decode_number(decoder);
+
+            return decode_fail(decoder, "unexpected character");
+    }
+}
+
+void load_json_metatables(lua_State* L);
+
+bool json_decode(lua_State* L, const char* data, size_t size) {
+    load_json_metatables(L);
+    JsonDecoder decoder = {L, data, data, data + size, nullptr, 0, {}};
+    int top = lua_gettop(L);
+
+    bool ok = decode_value(decoder);
+    if(ok) {
+        skip_whitespace(decoder);
+        if(decoder.cur < decoder.end)
+            ok = decode_fail(decoder, "trailing characters");
+    }
+
+    if(ok)
+        return true;
+
+    lua_settop(L, top);
+    lua_pushfstring(L, "Failed to parse JSON: %s at offset %d.", decoder.error, (int) (decoder.cur - decoder.start));
+    return false;
+}
+
+typedef struct JsonEncoder {
+    lua_State* L;
+    std::string& out;
+    bool pretty;
+    bool sort_keys;
+    std::string indent;
+    const void* array_marker;
+    const void* object_marker;
+    std::vector<const void*> path;
+    char error[128];
+} JsonEncoder;
+
+typedef struct JsonKey {
+    std::string text;
+    bool integer;
+    lua_Integer value;
+} JsonKey;
+
+bool encode_value(JsonEncoder& encoder, int index);
+
+bool encode_fail(JsonEncoder& encoder, const char* error, const char* detail = "") {
+    snprintf(encoder.error, sizeof(encoder.error), error, detail);
+    return false;
+}
+
+void encode_string(std::string& out, const char* data, size_t size) {
+    static const char* hex = "0123456789abcdef";
+    const char* run = data;
+    const char* end = data + size;
+
+    out += '"';
+    for(const char* c = data; c < end; c++) {
+        unsigned char ch = *c;
+        if(ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+
+        out.append(run, c - run);
+        run = c + 1;
+
+        switch(ch) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hex[ch >> 4];
+                out += hex[ch & 0xF];
+        }
+    }
+
+    out.append(run, end - run);
+    out += '"';
+}
+
+// Floats are written with the shortest precision that reads back exactly
+// and always keep a '.' or exponent, so they decode as floats again.
+bool format_number(JsonEncoder& encoder, lua_Number number, std::string& out) {
+    if(std::isnan(number) || std::isinf(number))
+        return encode_fail(encoder, "cannot encode %s", std::isnan(number) ? "NaN" : "infinity");
+
+    char buffer[32];
+    int size = snprintf(buffer, sizeof(buffer), "%.15g", number);
+    if(strtod(buffer, nullptr) != number)
+        size = snprintf(buffer, sizeof(buffer), "%.17g", number);
+
+    char point = localeconv()->decimal_point[0];
+    bool integral = true;
+
+    for(int i = 0; i < size; i++) {
+        if(buffer[i] == point)
+            buffer[i] = '.';
+        if(buffer[i] == '.' || buffer[i] == 'e')
+            integral = false;
+    }
+
+    out.append(buffer, size);
+    if(integral)
+        out += ".0";
+
+    return true;
+}
+
+void encode_integer(std::string& out, lua_Integer value) {
+    char buffer[32];
+    int size = snprintf(buffer, sizeof(buffer), LUA_INTEGER_FMT, value);
+    out.append(buffer, size);
+}
+
+void encode_newline(JsonEncoder& encoder, size_t depth) {
+    if(!encoder.pretty)
+        return;
+
+    encoder.out += '\n';
+    for(size_t i = 0; i < depth; i++)
+        encoder.out += encoder.indent;
+}
+
+// A table is an array when it is marked with json.array, or when every key
+// is a positive integer and at most half of the slots up to the largest one
+// are holes, which are written as null. Unmarked empty tables are arrays.
+bool table_is_array(JsonEncoder& encoder, int index, lua_Integer& length) {
+    lua_State* L = encoder.L;
+
+    if(lua_getmetatable(L, index)) {
+        const void* marker = lua_topointer(L, -1);
+        lua_pop(L, 1);
+
+        if(marker == encoder.array_marker) {
+            length = lua_rawlen(L, index);
+            return true;
+        }
+        if(marker == encoder.object_marker)
+            return false;
     }
 
+    lua_Integer count = 0;
+    lua_Integer max = 0;
+
     lua_pushnil(L);
-    if (lua_next(L, index) != 0) {
-        lua_pop(L, 2);
-        return 0;
+    while(lua_next(L, index) != 0) {
+        lua_pop(L, 1);
+
+        if(!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1) {
+            lua_pop(L, 1);
+            return false;
+        }
+
+        count++;
+        max = std::max(max, (lua_Integer) lua_tointeger(L, -1));
     }
 
-    return 1;
+    if(max > count * 2)
+        return false;
+
+    length = max;
+    return true;
 }
-void encode_lua_table(lua_State* L, int index, Json::Value& json_value) {
-    if (is_array(L, index)) {
-        json_value = Json::Value(Json::arrayValue);
-        size_t len = lua_rawlen(L, index);
-        for (size_t i = 1; i <= len; ++i) {
-            lua_rawgeti(L, index, i);
-            if (lua_istable(L, -1)) {
-                Json::Value nested_value;
-                encode_lua_table(L, lua_gettop(L), nested_value);
-                json_value.append(nested_value);
-            } else if (lua_isboolean(L, -1)) {
-                json_value.append(lua_toboolean(L, -1) != 0);
-            } else if (lua_isinteger(L, -1)) {
-                json_value.append((Json::Int)lua_tointeger(L, -1));
-            } else if (lua_isnumber(L, -1)) {
-                json_value.append(lua_tonumber(L, -1));
-            } else if (lua_isstring(L, -1)) {
-                json_value.append(lua_tostring(L, -1));
-            } else {
-                json_value.append(Json::Value());
+
+bool encode_array(JsonEncoder& encoder, int index, lua_Integer length) {
+    std::string& out = encoder.out;
+
+    if(length == 0) {
+        out += "[]";
+        return true;
+    }
+
+    out += '[';
+    for(lua_Integer i = 1; i <= length; i++) {
+        if(i > 1)
+            out += ',';
+        encode_newline(encoder, encoder.path.size());
+
+        lua_rawgeti(encoder.L, index, i);
+        bool ok = encode_value(encoder, lua_gettop(encoder.L));
+        lua_pop(encoder.L, 1);
+
+        if(!ok)
+            return false;
+    }
+
+    encode_newline(encoder, encoder.path.size() - 1);
+    out += ']';
+    return true;
+}
+
+bool read_key(JsonEncoder& encoder, int index, std::string& out) {
+    switch(lua_type(encoder.L, index)) {
+        case LUA_TSTRING: {
+            size_t size;
+            const char* key = lua_tolstring(encoder.L, index, &size);
+            encode_string(out, key, size);
+            return true;
+        }
+        case LUA_TNUMBER:
+            out += '"';
+            if(lua_isinteger(encoder.L, index))
+                encode_integer(out, lua_tointeger(encoder.L, index));
+            else if(!format_number(encoder, lua_tonumber(encoder.L, index), out))
+                return false;
+            out += '"';
+            return true;
+        default:
+            return encode_fail(encoder, "cannot encode a %s key", luaL_typename(encoder.L, index));
+    }
+}
+
+bool encode_member(JsonEncoder& encoder, int index, bool first) {
+    if(!first)
+        encoder.out += ',';
+    encode_newline(encoder, encoder.path.size());
+
+    if(!read_key(encoder, index - 1, encoder.out))
+        return false;
+
+    encoder.out += encoder.pretty ? ": " : ":";
+    return encode_value(encoder, index);
+}
+
+bool encode_sorted_object(JsonEncoder& encoder, int index, bool& empty) {
+    lua_State* L = encoder.L;
+    std::vector<JsonKey> keys;
+
+    lua_pushnil(L);
+    while(lua_next(L, index) != 0) {
+        lua_pop(L, 1);
+
+        JsonKey key;
+        key.integer = lua_isinteger(L, -1);
+        key.value = key.integer ? lua_tointeger(L, -1) : 0;
+
+        if(!key.integer) {
+            if(lua_type(L, -1) != LUA_TSTRING) {
+                encode_fail(encoder, "cannot sort a %s key", luaL_typename(L, -1));
+                lua_pop(L, 1);
+                return false;
             }
-            lua_pop(L, 1);
+            key.text = lua_tostring(L, -1);
         }
+
+        keys.push_back(std::move(key));
+    }
+
+    std::sort(keys.begin(), keys.end(), [](const JsonKey& a, const JsonKey& b) {
+        if(a.integer != b.integer)
+            return a.integer;
+        return a.integer ? a.value < b.value : a.text < b.text;
+    });
+
+    for(size_t i = 0; i < keys.size(); i++) {
+        if(keys[i].integer)
+            lua_pushinteger(L, keys[i].value);
+        else
+            lua_pushlstring(L, keys[i].text.data(), keys[i].text.size());
+        lua_pushvalue(L, -1);
+        lua_rawget(L, index);
+
+        bool ok = encode_member(encoder, lua_gettop(L), i == 0);
+        lua_pop(L, 2);
+
+        if(!ok)
+            return false;
+    }
+
+    empty = keys.empty();
+    return true;
+}
+
+bool encode_object(JsonEncoder& encoder, int index) {
+    lua_State* L = encoder.L;
+    std::string& out = encoder.out;
+    bool empty = true;
+
+    out += '{';
+
+    if(encoder.sort_keys) {
+        if(!encode_sorted_object(encoder, index, empty))
+            return false;
     } else {
-        json_value = Json::Value(Json::objectValue);
         lua_pushnil(L);
-        while (lua_next(L, index) != 0) {
-            const char* key = lua_tostring(L, -2);
-            if (lua_istable(L, -1)) {
-                Json::Value nested_value;
-                encode_lua_table(L, lua_gettop(L), nested_value);
-                json_value[key] = nested_value;
-            } else if (lua_isboolean(L, -1)) {
-                json_value[key] = lua_toboolean(L, -1) != 0;
-            } else if (lua_isinteger(L, -1)) {
-                json_value[key] = (Json::Int)lua_tointeger(L, -1);
-            } else if (lua_isnumber(L, -1)) {
-                json_value[key] = lua_tonumber(L, -1);
-            } else if (lua_isstring(L, -1)) {
-                json_value[key] = lua_tostring(L, -1);
-            } else {
-                json_value[key] = Json::Value();
+        while(lua_next(L, index) != 0) {
+            if(!encode_member(encoder, lua_gettop(L), empty)) {
+                lua_pop(L, 2);
+                return false;
             }
+
             lua_pop(L, 1);
+            empty = false;
         }
     }
+
+    if(!empty)
+        encode_newline(encoder, encoder.path.size() - 1);
+
+    out += '}';
+    return true;
 }
 
-int lua_json_encode(lua_State* L) {
-    if (!lua_istable(L, 1)) {
-        lua_pushstring(L, "Expected a table to encode to JSON");
-        lua_error(L);
+bool encode_table(JsonEncoder& encoder, int index) {
+    const void* table = lua_topointer(encoder.L, index);
+
+    if(std::find(encoder.path.begin(), encoder.path.end(), table) != encoder.path.end())
+        return encode_fail(encoder, "cannot encode a table that contains itself");
+    if(encoder.path.size() >= JSON_MAX_DEPTH)
+        return encode_fail(encoder, "nesting is too deep");
+    if(!lua_checkstack(encoder.L, 4))
+        return encode_fail(encoder, "nesting is too deep");
+
+    encoder.path.push_back(table);
+
+    lua_Integer length;
+    bool ok = table_is_array(encoder, index, length)
+        ? encode_array(encoder, index, length)
+        : encode_object(encoder, index);
+
+    encoder.path.pop_back();
+    return ok;
+}
+
+bool encode_value(JsonEncoder& encoder, int index) {
+    lua_State* L = encoder.L;
+
+    switch(lua_type(L, index)) {
+        case LUA_TNIL:
+            encoder.out += "null";
+            return true;
+        case LUA_TBOOLEAN:
+            encoder.out += lua_toboolean(L, index) ? "true" : "false";
+            return true;
+        case LUA_TNUMBER:
+            if(lua_isinteger(L, index)) {
+                encode_integer(encoder.out, lua_tointeger(L, index));
+                return true;
+            }
+            return format_number(encoder, lua_tonumber(L, index), encoder.out);
+        case LUA_TSTRING: {
+            size_t size;
+            const char* data = lua_tolstring(L, index, &size);
+            encode_string(encoder.out, data, size);
+            return true;
+        }
+        case LUA_TTABLE:
+            return encode_table(encoder, index);
+        default:
+            return encode_fail(encoder, "cannot encode a %s", luaL_typename(L, index));
     }
+}
 
-    Json::Value root;
-    encode_lua_table(L, 1, root);
+bool read_encode_options(lua_State* L, int index, JsonEncoder& encoder) {
+    if(lua_isnoneornil(L, index))
+        return true;
 
-    Json::StreamWriterBuilder writer;
-    std::string jsonString = Json::writeString(writer, root);
+    if(!lua_istable(L, index)) {
+        lua_pushstring(L, "The encode options must be a table.");
+        return false;
+    }
+
+    lua_getfield(L, index, "pretty");
+    encoder.pretty = lua_toboolean(L, -1);
+    lua_getfield(L, index, "sort_keys");
+    encoder.sort_keys = lua_toboolean(L, -1);
+    lua_getfield(L, index, "indent");
+
+    if(lua_isinteger(L, -1)) {
+        encoder.indent.assign(std::max((lua_Integer) 0, lua_tointeger(L, -1)), ' ');
+    } else if(lua_type(L, -1) == LUA_TSTRING) {
+        encoder.indent = lua_tostring(L, -1);
+    } else if(!lua_isnil(L, -1)) {
+        lua_pop(L, 3);
+        lua_pushstring(L, "The indent option must be a number or a string.");
+        return false;
+    }
+
+    lua_pop(L, 3);
+    return true;
+}
+
+// The output is built in a per-thread buffer that keeps its capacity between
+// calls, so encoding only allocates for the final Lua string.
+bool json_encode(lua_State* L, int index, int options) {
+    thread_local std::string buffer;
+    buffer.clear();
+
+    JsonEncoder encoder = {L, buffer, false, false, "  ", nullptr, nullptr, {}, {0}};
+    index = lua_absindex(L, index);
+    if(options != 0)
+        options = lua_absindex(L, options);
+
+    load_json_metatables(L);
+    luaL_getmetatable(L, JSON_ARRAY);
+    encoder.array_marker = lua_topointer(L, -1);
+    luaL_getmetatable(L, JSON_OBJECT);
+    encoder.object_marker = lua_topointer(L, -1);
+    lua_pop(L, 2);
+
+    if(options != 0 && !read_encode_options(L, options, encoder))
+        return false;
+
+    if(!encode_value(encoder, index)) {
+        lua_pushfstring(L, "Failed to encode JSON: %s.", encoder.error);
+        return false;
+    }
+
+    lua_pushlstring(L, buffer.data(), buffer.size());
+    return true;
+}
+
+int lua_json_encode(lua_State* L) {
+    luaL_checkany(L, 1);
+
+    if(!json_encode(L, 1, 2))
+        return lua_error(L);
 
-    lua_pushstring(L, jsonString.c_str());
     return 1;
 }
 
 int lua_json_decode(lua_State* L) {
-    const char* json_str = lua_tostring(L, 1);
-
-    Json::CharReaderBuilder reader;
-    Json::Value root;
-    std::string errors;
-
-    std::istringstream s(json_str);
-    if (!Json::parseFromStream(reader, s, &root, &errors)) {
-        lua_pushstring(L, errors.c_str());
-        lua_error(L);
-    }
-
-    lua_newtable(L);
-
-    if (root.isObject()) {
-        for (const auto& key : root.getMemberNames()) {
-            lua_pushstring(L, key.c_str());
-
-            const Json::Value& value = root[key];
-
-            if (value.isString()) {
-                lua_pushstring(L, value.asString().c_str());
-            } else if (value.isInt()) {
-                lua_pushinteger(L, value.asInt());
-            } else if (value.isBool()) {
-                lua_pushboolean(L, value.asBool());
-            } else if (value.isDouble()) {
-                lua_pushnumber(L, value.asDouble());
-            } else if (value.isArray() || value.isObject()) {
-                lua_pushcfunction(L, lua_json_decode);
-                lua_pushstring(L, value.toStyledString().c_str());
-                lua_call(L, 1, 1);
-            } else {
-                lua_pushnil(L);
+    size_t size;
+    const char* data = luaL_checklstring(L, 1, &size);
+
+    if(!json_decode(L, data, size))
+        return lua_error(L);
+
+    return 1;
+}
+
+#define LAZY_DOCUMENT "json.lazy.document"
+#define LAZY_VALUE "json.lazy"
+#define LAZY_INDEX_AFTER 16
+
+enum LazyType : uint8_t {
+    LAZY_OBJECT,
+    LAZY_ARRAY,
+    LAZY_STRING,
+    LAZY_SCALAR,
+};
+
+// One entry per value (and per object key) in document order. Containers
+// store their member count and every entry stores the index of the entry
+// after it, so siblings can be skipped without looking at their contents.
+// Strings store their raw length instead of a count.
+typedef struct LazyNode {
+    uint32_t start;
+    uint32_t next;
+    uint32_t count;
+    LazyType type;
+    bool escaped;
+} LazyNode;
+
+typedef struct LazyDocument {
+    const char* data;
+    size_t size;
+    std::vector<LazyNode> nodes;
+    std::unordered_map<uint32_t, std::unordered_map<std::string_view, uint32_t>> objects;
+    // Decoded copies of escaped keys, which the hash indexes point into.
+    std::deque<std::string> keys;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> arrays;
+} LazyDocument;
+
+typedef struct LazyValue {
+    LazyDocument* document;
+    uint32_t node;
+} LazyValue;
+
+bool index_value(JsonDecoder& decoder, std::vector<LazyNode>& nodes) {
+    skip_whitespace(decoder);
+    if(decoder.cur >= decoder.end)
+        return decode_fail(decoder, "unexpected end of input");
+
+    uint32_t self = nodes.size();
+    nodes.push_back({(uint32_t) (decoder.cur - decoder.start), 0, 0, LAZY_SCALAR, false});
+
+    char c = *decoder.cur;
+    bool ok = true;
+
+    if(c == '{' || c == '[') {
+        bool object = c == '{';
+        char close = object ? '}' : ']';
+        uint32_t count = 0;
+
+        if(++decoder.depth > JSON_MAX_DEPTH)
+            return decode_fail(decoder, "nesting is too deep");
+
+        decoder.cur++;
+        skip_whitespace(decoder);
+
+        if(decoder.cur < decoder.end && *decoder.cur == close) {
+            decoder.cur++;
+        } else {
+            while(true) {
+                if(object) {
+                    if(decoder.cur >= decoder.end || *decoder.cur != '"')
+                        return decode_fail(decoder, "expected a string key");
+                    if(!index_value(decoder, nodes))
+                        return false;
+
+                    skip_whitespace(decoder);
+                    if(decoder.cur >= decoder.end || *decoder.cur != ':')
+                        return decode_fail(decoder, "expected ':'");
+                    decoder.cur++;
+                }
+
+                if(!index_value(decoder, nodes))
+                    return false;
+                count++;
+
+                skip_whitespace(decoder);
+                if(decoder.cur >= decoder.end)
+                    return decode_fail(decoder, object ? "unterminated object" : "unterminated array");
+
+                char next = *decoder.cur++;
+                if(next == close)
+                    break;
+                if(next != ',')
+                    return decode_fail(decoder, object ? "expected ',' or '}'" : "expected ',' or ']'");
+
+                skip_whitespace(decoder);
             }
+        }
+
+        decoder.depth--;
+        nodes[self].type = object ? LAZY_OBJECT : LAZY_ARRAY;
+        nodes[self].count = count;
+    } else if(c == '"') {
+        bool escaped;
+        ok = scan_string(decoder, escaped);
+
+        nodes[self].type = LAZY_STRING;
+        nodes[self].escaped = escaped;
+        nodes[self].count = decoder.cur - decoder.start - nodes[self].start - 2;
+    } else if(c == 't') {
+        ok = decode_literal(decoder, "true", 4);
+    } else if(c == 'f') {
+        ok = decode_literal(decoder, "false", 5);
+    } else if(c == 'n') {
+        ok = decode_literal(decoder, "null", 4);
+    } else if(c == '-' || (c >= '0' && c <= '9')) {
+        ok = scan_number(decoder);
+    } else {
+        ok = decode_fail(decoder, "unexpected character");
+    }
+
+    nodes[self].next = nodes.size();
+    return ok;
+}
+
+bool index_json(lua_State* L, LazyDocument& document) {
+    JsonDecoder decoder = {L, document.data, document.data, document.data + document.size, nullptr, 0, {}};
+    bool ok = document.size <= UINT32_MAX
+        ? index_value(decoder, document.nodes)
+        : decode_fail(decoder, "document is too large");
+
+    if(ok) {
+        skip_whitespace(decoder);
+        if(decoder.cur < decoder.end)
+            ok = decode_fail(decoder, "trailing characters");
+    }
+
+    if(ok)
+        return true;
+
+    lua_pushfstring(L, "Failed to parse JSON: %s at offset %d.", decoder.error, (int) (decoder.cur - decoder.start));
+    return false;
+}
+
+void push_lazy_value(lua_State* L, int document, uint32_t node);
 
-            lua_settable(L, -3);
-        }
-    }
-    else if (root.isArray()) {
-        for (Json::ArrayIndex i = 0; i < root.size(); ++i) {
-            lua_pushinteger(L, i + 1);
-
-            const Json::Value& value = root[i];
-
-            if (value.isString()) {
-                lua_pushstring(L, value.asString().c_str());
-            } else if (value.isInt()) {
-                lua_pushinteger(L, value.asInt());
-            } else if (value.isBool()) {
-                lua_pushboolean(L, value.asBool());
-            } else if (value.isDouble()) {
-                lua_pushnumber(L, value.asDouble());
-            } else if (value.isArray() || value.isObject()) {
-                lua_pushcfunction(L, lua_json_decode);
-                lua_pushstring(L, value.toStyledString().c_str());
-                lua_call(L, 1, 1);
-            } else {
-                lua_pushnil(L);
+// Scalars are decoded from their position in the source every time they
+// are read; containers become another proxy sharing the same document.
+void push_lazy_node(lua_State* L, int document, LazyDocument* doc, uint32_t node) {
+    const LazyNode& entry = doc->nodes[node];
+
+    if(entry.type == LAZY_OBJECT || entry.type == LAZY_ARRAY) {
+        push_lazy_value(L, document, node);
+        return;
+    }
+
+    if(entry.type == LAZY_STRING && !entry.escaped) {
+        lua_pushlstring(L, doc->data + entry.start + 1, entry.count);
+        return;
+    }
+
+    JsonDecoder decoder = {L, doc->data, doc->data + entry.start, doc->data + doc->size, nullptr, 0, {}};
+    decode_value(decoder);
+}
+
+void push_lazy_value(lua_State* L, int document, uint32_t node) {
+    LazyValue* value = (LazyValue*) lua_newuserdatauv(L, sizeof(LazyValue), 1);
+    value->document = (LazyDocument*) lua_touserdata(L, document);
+    value->node = node;
+
+    lua_pushvalue(L, document);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, LAZY_VALUE);
+}
+
+bool key_matches(lua_State* L, LazyDocument* doc, uint32_t node, const char* key, size_t size) {
+    const LazyNode& entry = doc->nodes[node];
+
+    if(!entry.escaped)
+        return entry.count == size && memcmp(doc->data + entry.start + 1, key, size) == 0;
+
+    JsonDecoder decoder = {L, doc->data, doc->data + entry.start, doc->data + doc->size, nullptr, 0, {}};
+    decode_string(decoder);
+
+    size_t decoded_size;
+    const char* decoded = lua_tolstring(L, -1, &decoded_size);
+    bool matches = decoded_size == size && memcmp(decoded, key, size) == 0;
+    lua_pop(L, 1);
+
+    return matches;
+}
+
+// Small objects are searched in place; larger ones get a hash index the
+// first time they are read. Keys with escapes are decoded once for it.
+uint32_t find_member(lua_State* L, LazyDocument* doc, uint32_t object, const char* key, size_t size) {
+    const LazyNode& entry = doc->nodes[object];
+
+    if(entry.count > LAZY_INDEX_AFTER) {
+        auto found = doc->objects.find(object);
+
+        if(found == doc->objects.end()) {
+            std::unordered_map<std::string_view, uint32_t> members;
+            uint32_t child = object + 1;
+
+            for(uint32_t i = 0; i < entry.count; i++) {
+                const LazyNode& name = doc->nodes[child];
+                std::string_view view(doc->data + name.start + 1, name.count);
+
+                if(name.escaped) {
+                    JsonDecoder decoder = {L, doc->data, doc->data + name.start, doc->data + doc->size, nullptr, 0, {}};
+                    decode_string(decoder);
+
+                    size_t decoded_size;
+                    const char* decoded = lua_tolstring(L, -1, &decoded_size);
+                    doc->keys.emplace_back(decoded, decoded_size);
+                    lua_pop(L, 1);
+
+                    view = doc->keys.back();
+                }
+
+                members.insert_or_assign(view, child + 1);
+                child = doc->nodes[child + 1].next;
             }
 
-            lua_settable(L, -3);
+            found = doc->objects.emplace(object, std::move(members)).first;
         }
-    } else {
+
+        auto member = found->second.find(std::string_view(key, size));
+        return member == found->second.end() ? 0 : member->second;
+    }
+
+    // The last duplicate wins, the same as in json.decode.
+    uint32_t member = 0;
+    uint32_t child = object + 1;
+    for(uint32_t i = 0; i < entry.count; i++) {
+        if(key_matches(L, doc, child, key, size))
+            member = child + 1;
+
+        child = doc->nodes[child + 1].next;
+    }
+
+    return member;
+}
+
+uint32_t find_element(LazyDocument* doc, uint32_t array, lua_Integer index) {
+    const LazyNode& entry = doc->nodes[array];
+    if(index < 1 || index > entry.count)
+        return 0;
+
+    if(entry.count > LAZY_INDEX_AFTER) {
+        std::vector<uint32_t>& elements = doc->arrays[array];
+
+        if(elements.empty()) {
+            elements.reserve(entry.count);
+            for(uint32_t child = array + 1; child < entry.next; child = doc->nodes[child].next)
+                elements.push_back(child);
+        }
+
+        return elements[index - 1];
+    }
+
+    uint32_t child = array + 1;
+    for(lua_Integer i = 1; i < index; i++)
+        child = doc->nodes[child].next;
+
+    return child;
+}
+
+// Returns the node for a key of a container, or 0 when it doesn't exist.
+uint32_t lazy_lookup(lua_State* L, LazyDocument* doc, uint32_t node, int key) {
+    const LazyNode& entry = doc->nodes[node];
+
+    if(entry.type == LAZY_ARRAY) {
+        if(!lua_isinteger(L, key))
+            return 0;
+
+        return find_element(doc, node, lua_tointeger(L, key));
+    }
+
+    if(lua_type(L, key) != LUA_TSTRING)
+        return 0;
+
+    size_t size;
+    const char* name = lua_tolstring(L, key, &size);
+    return find_member(L, doc, node, name, size);
+}
+
+LazyValue* check_lazy(lua_State* L, int index) {
+    return (LazyValue*) luaL_checkudata(L, index, LAZY_VALUE);
+}
+
+int lua_lazy_get(lua_State* L) {
+    LazyValue* value = check_lazy(L, 1);
+    size_t size;
+    const char* path = luaL_checklstring(L, 2, &size);
+
+    LazyDocument* doc = value->document;
+    uint32_t node = value->node;
+    const char* end = path + size;
+
+    lua_getiuservalue(L, 1, 1);
+    int document = lua_gettop(L);
+
+    // Node 0 is the root, which is never a member, so it doubles as "missing".
+    do {
+        const char* dot = (const char*) memchr(path, '.', end - path);
+        if(dot == nullptr)
+            dot = end;
+
+        const LazyNode& entry = doc->nodes[node];
+        if(entry.type == LAZY_OBJECT) {
+            node = find_member(L, doc, node, path, dot - path);
+        } else if(entry.type == LAZY_ARRAY) {
+            lua_pushlstring(L, path, dot - path);
+            node = lua_stringtonumber(L, lua_tostring(L, -1)) != 0 && lua_isinteger(L, -1)
+                ? find_element(doc, node, lua_tointeger(L, -1))
+                : 0;
+            lua_settop(L, document);
+        } else {
+            node = 0;
+        }
+
+        path = dot + 1;
+    } while(path <= end && node != 0);
+
+    if(node == 0)
+        lua_pushnil(L);
+    else
+        push_lazy_node(L, document, doc, node);
+
+    return 1;
+}
+
+int lua_lazy_decode(lua_State* L) {
+    LazyValue* value = check_lazy(L, 1);
+    LazyDocument* doc = value->document;
+
+    JsonDecoder decoder = {L, doc->data, doc->data + doc->nodes[value->node].start, doc->data + doc->size, nullptr, 0, {}};
+    decode_value(decoder);
+
+    return 1;
+}
+
+int lua_lazy_index(lua_State* L) {
+    LazyValue* value = check_lazy(L, 1);
+
+    if(lua_type(L, 2) == LUA_TSTRING) {
+        const char* key = lua_tostring(L, 2);
+
+        if(strcmp(key, "get") == 0) {
+            lua_pushcfunction(L, lua_lazy_get);
+            return 1;
+        } else if(strcmp(key, "decode") == 0) {
+            lua_pushcfunction(L, lua_lazy_decode);
+            return 1;
+        }
+    }
+
+    uint32_t node = lazy_lookup(L, value->document, value->node, 2);
+    if(node == 0) {
         lua_pushnil(L);
+        return 1;
     }
 
+    lua_getiuservalue(L, 1, 1);
+    push_lazy_node(L, lua_gettop(L), value->document, node);
     return 1;
 }
 
+int lua_lazy_len(lua_State* L) {
+    LazyValue* value = check_lazy(L, 1);
+    const LazyNode& entry = value->document->nodes[value->node];
+
+    lua_pushinteger(L, entry.type == LAZY_ARRAY ? entry.count : 0);
+    return 1;
+}
+
+// Upvalues: the value being iterated, the next child node and the next
+// array index.
+int lazy_next(lua_State* L) {
+    LazyValue* value = check_lazy(L, lua_upvalueindex(1));
+    LazyDocument* doc = value->document;
+    const LazyNode& entry = doc->nodes[value->node];
+
+    uint32_t child = lua_tointeger(L, lua_upvalueindex(2));
+    lua_Integer index = lua_tointeger(L, lua_upvalueindex(3));
+
+    if(child >= entry.next)
+        return 0;
+
+    lua_getiuservalue(L, lua_upvalueindex(1), 1);
+    int document = lua_gettop(L);
+
+    uint32_t node = child;
+    if(entry.type == LAZY_OBJECT) {
+        push_lazy_node(L, document, doc, child);
+        node = child + 1;
+    } else {
+        lua_pushinteger(L, index);
+    }
+
+    push_lazy_node(L, document, doc, node);
+
+    lua_pushinteger(L, doc->nodes[node].next);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushinteger(L, index + 1);
+    lua_replace(L, lua_upvalueindex(3));
+
+    return 2;
+}
+
+int lua_lazy_pairs(lua_State* L) {
+    LazyValue* value = check_lazy(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, value->node + 1);
+    lua_pushinteger(L, 1);
+    lua_pushcclosure(L, lazy_next, 3);
+
+    return 1;
+}
+
+int lua_lazy_tostring(lua_State* L) {
+    LazyValue* value = check_lazy(L, 1);
+    const LazyNode& entry = value->document->nodes[value->node];
+
+    lua_pushfstring(L, "json.lazy (%s): %p", entry.type == LAZY_OBJECT ? "object" : "array", value);
+    return 1;
+}
+
+int lua_lazy_document_gc(lua_State* L) {
+    LazyDocument* doc = (LazyDocument*) luaL_checkudata(L, 1, LAZY_DOCUMENT);
+    doc->~LazyDocument();
+
+    return 0;
+}
+
+int lua_json_lazy(lua_State* L) {
+    size_t size;
+    const char* data = luaL_checklstring(L, 1, &size);
+
+    LazyDocument* doc = (LazyDocument*) lua_newuserdatauv(L, sizeof(LazyDocument), 1);
+    new (doc) LazyDocument();
+    luaL_setmetatable(L, LAZY_DOCUMENT);
+    int document = lua_gettop(L);
+
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, document, 1);
+
+    doc->data = data;
+    doc->size = size;
+
+    if(!index_json(L, *doc))
+        return lua_error(L);
+
+    push_lazy_node(L, document, doc, 0);
+    return 1;
+}
+
+void load_lazy_metatables(lua_State* L) {
+    luaL_newmetatable(L, LAZY_DOCUMENT);
+    lua_pushcfunction(L, lua_lazy_document_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LAZY_VALUE);
+    lua_pushcfunction(L, lua_lazy_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_lazy_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_lazy_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushcfunction(L, lua_lazy_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+}
+
+// The markers are also needed by json_decode and json_encode when they are
+// called from other libraries before json itself has been loaded.
+void load_json_metatables(lua_State* L) {
+    if(!luaL_newmetatable(L, JSON_ARRAY)) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pop(L, 1);
+    luaL_newmetatable(L, JSON_OBJECT);
+    lua_pop(L, 1);
+}
+
 void load_json_library(lua_State* L) {
-    lua_createtable(L, 0, 2);
+    load_json_metatables(L);
+
+    lua_createtable(L, 0, 5);
     lua_pushcfunction(L, lua_json_decode);
     lua_setfield(L, -2, "decode");
     lua_pushcfunction(L, lua_json_encode);
     lua_setfield(L, -2, "encode");
+
+    luaL_getmetatable(L, JSON_ARRAY);
+    lua_setfield(L, -2, "array");
+    luaL_getmetatable(L, JSON_OBJECT);
+    lua_setfield(L, -2, "object");
+
+    load_lazy_metatables(L);
+    lua_pushcfunction(L, lua_json_lazy);
+    lua_setfield(L, -2, "lazy");
+
     lua_setglobal(L, "json");
 }
@@ -1,8 +1,9 @@
-#include <json/json.h>
+#include <cstddef>
 
 extern "C" {
     #include <lua.h>
 }
 
-void json_to_lua_table(lua_State* L, Json::Value json);
+bool json_decode(lua_State* L, const char* data, size_t size);
+bool json_encode(lua_State* L, int index, int options);
 void load_json_library(lua_State* L);
@@ -0,0 +1,136 @@
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "limiter.h"
+
+#define LIMITER_DEFAULT "*"
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct Bucket {
+    HostLimit limit;
+    double tokens = 0;
+    int active = 0;
+    Clock::time_point updated;
+    Clock::time_point paused_until;
+} Bucket;
+
+std::mutex limiter_mutex;
+std::condition_variable limiter_released;
+std::unordered_map<std::string, HostLimit> limits;
+std::unordered_map<std::string, Bucket> buckets;
+
+const HostLimit& find_limit(const std::string& name) {
+    static const HostLimit unlimited;
+
+    auto found = limits.find(name);
+    if(found == limits.end())
+        found = limits.find(LIMITER_DEFAULT);
+
+    return found == limits.end() ? unlimited : found->second;
+}
+
+Bucket& find_bucket(const std::string& name) {
+    auto found = buckets.find(name);
+    if(found != buckets.end())
+        return found->second;
+
+    Bucket& bucket = buckets[name];
+    bucket.limit = find_limit(name);
+    bucket.tokens = bucket.limit.burst;
+    bucket.updated = Clock::now();
+
+    return bucket;
+}
+
+// Returns 0 when a slot was taken, the seconds until a token is available,
+// or -1 when the host is at its concurrency limit.
+double try_acquire(Bucket& bucket) {
+    Clock::time_point now = Clock::now();
+
+    if(now < bucket.paused_until)
+        return std::chrono::duration<double>(bucket.paused_until - now).count();
+
+    if(bucket.limit.concurrency > 0 && bucket.active >= bucket.limit.concurrency)
+        return -1;
+
+    if(bucket.limit.rate > 0) {
+        double elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+        bucket.tokens = std::min(bucket.limit.burst, bucket.tokens + elapsed * bucket.limit.rate);
+        bucket.updated = now;
+
+        if(bucket.tokens < 1)
+            return (1 - bucket.tokens) / bucket.limit.rate;
+
+        bucket.tokens -= 1;
+    }
+
+    bucket.active++;
+    return 0;
+}
+
+std::string limiter_host_name(const std::string& host) {
+    size_t start = host.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+
+    size_t end = host.find(':', start);
+    if(end == std::string::npos)
+        end = host.size();
+
+    return host.substr(start, end - start);
+}
+
+void limiter_set(const std::string& name, const HostLimit& limit) {
+    std::lock_guard<std::mutex> lock(limiter_mutex);
+    limits[name] = limit;
+
+    for(auto& [bucket_name, bucket] : buckets) {
+        if(bucket_name != name && name != LIMITER_DEFAULT)
+            continue;
+
+        bucket.limit = find_limit(bucket_name);
+        bucket.tokens = std::min(bucket.tokens, bucket.limit.burst);
+    }
+
+    limiter_released.notify_all();
+}
+
+double limiter_try_acquire(const std::string& name) {
+    std::lock_guard<std::mutex> lock(limiter_mutex);
+    return try_acquire(find_bucket(name));
+}
+
+void limiter_acquire(const std::string& name) {
+    std::unique_lock<std::mutex> lock(limiter_mutex);
+    Bucket& bucket = find_bucket(name);
+
+    double wait;
+    while((wait = try_acquire(bucket)) != 0) {
+        if(wait < 0)
+            limiter_released.wait(lock);
+        else
+            limiter_released.wait_for(lock, std::chrono::duration<double>(wait));
+    }
+}
+
+void limiter_release(const std::string& name) {
+    std::lock_guard<std::mutex> lock(limiter_mutex);
+    Bucket& bucket = find_bucket(name);
+
+    if(bucket.active > 0)
+        bucket.active--;
+
+    limiter_released.notify_all();
+}
+
+void limiter_pause(const std::string& name, double seconds) {
+    std::lock_guard<std::mutex> lock(limiter_mutex);
+    Bucket& bucket = find_bucket(name);
+
+    Clock::time_point until = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    bucket.paused_until = std::max(bucket.paused_until, until);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+typedef struct HostLimit {
+    double rate = 0;
+    double burst = 1;
+    int concurrency = 0;
+} HostLimit;
+
+std::string limiter_host_name(const std::string& host);
+void limiter_set(const std::string& name, const HostLimit& limit);
+double limiter_try_acquire(const std::string& name);
+void limiter_acquire(const std::string& name);
+void limiter_release(const std::string& name);
+void limiter_pause(const std::string& name, double seconds);
@@ -1,5 +1,20 @@
 #include "libxml/parser.h"
+#include "parser.h"
+#include "request.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 extern "C" {
     #include <libxml/HTMLparser.h>
@@ -8,19 +23,252 @@ extern "C" {
     #include <lauxlib.h>
 }
 
+#define DOCUMENT_METATABLE "html.document"
+#define NODE_METATABLE "html.node"
+#define XPATH_METATABLE "html.xpath"
+#define XPATH_CACHE_SIZE 64
+
+// Node userdata uservalues: the document that owns the node, and the
+// `children` and `attributes` tables once they have been built.
+#define NODE_OWNER 1
+#define NODE_CHILDREN 2
+#define NODE_ATTRIBUTES 3
+
+typedef struct Document {
+    htmlDocPtr doc;
+    xmlXPathContextPtr ctx;
+} Document;
+
+typedef struct Node {
+    xmlNodePtr node;
+} Node;
+
+std::atomic<size_t> live_documents{0};
+std::atomic<size_t> parsed_documents{0};
+std::atomic<size_t> xml_bytes{0};
+std::atomic<size_t> compiled_expressions{0};
+
+typedef struct XPath {
+    xmlXPathCompExprPtr comp;
+} XPath;
+
+typedef struct XPathCache {
+    std::list<std::pair<std::string, xmlXPathCompExprPtr>> entries;
+    std::unordered_map<std::string, std::list<std::pair<std::string, xmlXPathCompExprPtr>>::iterator> index;
+    // Nothing is evicted while a call still holds expressions from the
+    // cache, the cache is trimmed again once it lets go.
+    bool pinned = false;
+
+    ~XPathCache() {
+        for (auto& entry : entries)
+            xmlXPathFreeCompExpr(entry.second);
+    }
+} XPathCache;
+
+// Compiled expressions are not shared between threads, so every thread
+// keeps its own cache.
+thread_local XPathCache xpath_cache;
+
+// libxml2 allocations are prefixed with their size so html.stats() can
+// report how much memory the parsed documents are holding on to.
+#define XML_HEADER_SIZE alignof(std::max_align_t)
+
+void* xml_malloc(size_t size) {
+    char* block = (char*) malloc(size + XML_HEADER_SIZE);
+    if (block == NULL)
+        return NULL;
+
+    *(size_t*) block = size;
+    xml_bytes += size;
+
+    return block + XML_HEADER_SIZE;
+}
+
+void* xml_realloc(void* ptr, size_t size) {
+    if (ptr == NULL)
+        return xml_malloc(size);
+
+    char* block = (char*) ptr - XML_HEADER_SIZE;
+    size_t old_size = *(size_t*) block;
+
+    block = (char*) realloc(block, size + XML_HEADER_SIZE);
+    if (block == NULL)
+        return NULL;
+
+    *(size_t*) block = size;
+    xml_bytes += size;
+    xml_bytes -= old_size;
+
+    return block + XML_HEADER_SIZE;
+}
+
+void xml_free(void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    char* block = (char*) ptr - XML_HEADER_SIZE;
+    xml_bytes -= *(size_t*) block;
+
+    free(block);
+}
+
+char* xml_strdup(const char* str) {
+    size_t size = strlen(str) + 1;
+
+    char* copy = (char*) xml_malloc(size);
+    if (copy != NULL)
+        memcpy(copy, str, size);
+
+    return copy;
+}
+
+void close_document(Document* document) {
+    if (document->doc == NULL)
+        return;
+
+    if (document->ctx != NULL) {
+        xmlXPathFreeContext(document->ctx);
+        document->ctx = NULL;
+    }
+
+    xmlFreeDoc(document->doc);
+    document->doc = NULL;
+    live_documents--;
+}
+
+Document* check_document(lua_State* L, int index) {
+    Document* document = (Document*) luaL_checkudata(L, index, DOCUMENT_METATABLE);
+
+    if (document->doc == NULL)
+        luaL_error(L, "The document has been closed.");
+
+    return document;
+}
+
+xmlNodePtr check_node(lua_State* L, int index, Document** owner) {
+    Node* handle = (Node*) luaL_checkudata(L, index, NODE_METATABLE);
+
+    lua_getiuservalue(L, index, NODE_OWNER);
+    Document* document = (Document*) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (document == NULL || document->doc == NULL)
+        luaL_error(L, "The document has been closed.");
+
+    if (owner != NULL)
+        *owner = document;
+
+    return handle->node;
+}
+
+xmlXPathCompExprPtr compile_xpath(const char* xpath) {
+    xmlXPathCompExprPtr comp = xmlXPathCompile((const xmlChar*) xpath);
+    if (comp != NULL)
+        compiled_expressions++;
+
+    return comp;
+}
+
+void trim_xpath_cache() {
+    while (xpath_cache.entries.size() > XPATH_CACHE_SIZE) {
+        xmlXPathFreeCompExpr(xpath_cache.entries.back().second);
+        xpath_cache.index.erase(xpath_cache.entries.back().first);
+        xpath_cache.entries.pop_back();
+    }
+}
+
+xmlXPathCompExprPtr cached_xpath(const char* xpath) {
+    std::string key = xpath;
+
+    auto found = xpath_cache.index.find(key);
+    if (found != xpath_cache.index.end()) {
+        xpath_cache.entries.splice(xpath_cache.entries.begin(), xpath_cache.entries, found->second);
+        return found->second->second;
+    }
+
+    xmlXPathCompExprPtr comp = compile_xpath(xpath);
+    if (comp == NULL)
+        return NULL;
+
+    xpath_cache.entries.emplace_front(key, comp);
+    xpath_cache.index[key] = xpath_cache.entries.begin();
+
+    if (!xpath_cache.pinned)
+        trim_xpath_cache();
+
+    return comp;
+}
+
+// Accepts either a handle from html.compile or an XPath string, which is
+// compiled once and then reused from the cache.
+xmlXPathCompExprPtr check_xpath(lua_State* L, int index) {
+    XPath* handle = (XPath*) luaL_testudata(L, index, XPATH_METATABLE);
+    if (handle != NULL)
+        return handle->comp;
+
+    if (!lua_isstring(L, index)) {
+        luaL_error(L, "Expected XPath to be a string.");
+        return NULL;
+    }
+
+    xmlXPathCompExprPtr comp = cached_xpath(lua_tostring(L, index));
+    if (comp == NULL)
+        luaL_error(L, "Invalid XPath expression '%s'.", lua_tostring(L, index));
+
+    return comp;
+}
+
+bool ensure_context(Document* document) {
+    if (document->ctx != NULL)
+        return true;
+
+    document->ctx = xmlXPathNewContext(document->doc);
+    if (document->ctx == NULL)
+        return false;
+
+    xmlXPathContextSetCache(document->ctx, 1, -1, 0);
+    return true;
+}
+
+xmlXPathObjectPtr evaluate_xpath(lua_State* L, Document* document, xmlNodePtr node, xmlXPathCompExprPtr comp) {
+    if (!ensure_context(document)) {
+        luaL_error(L, "Failed to create XPath context.");
+        return NULL;
+    }
+
+    document->ctx->node = node;
+    return xmlXPathCompiledEval(comp, document->ctx);
+}
+
 int lua_node_search(lua_State* L);
 
-void populate_node_table(lua_State* L, xmlNodePtr node) {
-    lua_newtable(L);
+void push_node(lua_State* L, xmlNodePtr node, int owner) {
+    owner = lua_absindex(L, owner);
+
+    Node* handle = (Node*) lua_newuserdatauv(L, sizeof(Node), 3);
+    handle->node = node;
+    luaL_setmetatable(L, NODE_METATABLE);
 
-    lua_pushstring(L, (const char*)node->name);
-    lua_setfield(L, -2, "name");
+    lua_pushvalue(L, owner);
+    lua_setiuservalue(L, -2, NODE_OWNER);
+}
+
+void push_node_set(lua_State* L, xmlNodeSetPtr set, int owner) {
+    owner = lua_absindex(L, owner);
 
-    xmlChar* content = xmlNodeGetContent(node);
-    lua_pushstring(L, content ? (const char*)content : "");
-    lua_setfield(L, -2, "text");
-    if (content) xmlFree(content);
+    int count = set ? set->nodeNr : 0;
+    lua_createtable(L, count, 0);
 
+    for (int i = 0; i < count; i++) {
+        xmlNodePtr node = set->nodeTab[i];
+        if (node) {
+            push_node(L, node, owner);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+}
+
+void push_attributes(lua_State* L, xmlNodePtr node) {
     lua_newtable(L);
     for (xmlAttrPtr attr = node->properties; attr; attr = attr->next) {
         xmlChar* value = xmlNodeListGetString(node->doc, attr->children, 1);
@@ -30,124 +278,1087 @@ void populate_node_table(lua_State* L, xmlNodePtr node) {
             xmlFree(value);
         }
     }
-    lua_setfield(L, -2, "attributes");
+}
+
+void push_children(lua_State* L, xmlNodePtr node, int owner) {
+    owner = lua_absindex(L, owner);
 
     lua_newtable(L);
     int index = 1;
     for (xmlNodePtr child = node->children; child; child = child->next) {
         if (child->type == XML_ELEMENT_NODE) {
-            populate_node_table(L, child); 
+            push_node(L, child, owner);
             lua_rawseti(L, -2, index++);
         }
     }
-    lua_setfield(L, -2, "children");
+}
+
+// Pushes the table cached in uservalue `slot`, building it on first access.
+void push_cached(lua_State* L, int self, int slot) {
+    if (lua_getiuservalue(L, self, slot) != LUA_TNIL)
+        return;
+    lua_pop(L, 1);
+
+    Node* handle = (Node*) lua_touserdata(L, self);
+
+    if (slot == NODE_CHILDREN) {
+        lua_getiuservalue(L, self, NODE_OWNER);
+        push_children(L, handle->node, -1);
+        lua_remove(L, -2);
+    } else {
+        push_attributes(L, handle->node);
+    }
 
-    lua_pushlightuserdata(L, node);
-    lua_setfield(L, -2, "node_ptr");
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, self, slot);
+}
+
+int node_index(lua_State* L) {
+    xmlNodePtr node = check_node(L, 1, NULL);
+    const char* key = luaL_checkstring(L, 2);
+
+    if (strcmp(key, "name") == 0) {
+        lua_pushstring(L, (const char*)node->name);
+    } else if (strcmp(key, "text") == 0) {
+        xmlChar* content = xmlNodeGetContent(node);
+        lua_pushstring(L, content ? (const char*)content : "");
+        if (content) xmlFree(content);
+    } else if (strcmp(key, "attributes") == 0) {
+        push_cached(L, 1, NODE_ATTRIBUTES);
+    } else if (strcmp(key, "children") == 0) {
+        push_cached(L, 1, NODE_CHILDREN);
+    } else if (strcmp(key, "xpath") == 0) {
+        lua_pushcfunction(L, lua_node_search);
+    } else if (strcmp(key, "node_ptr") == 0) {
+        lua_pushlightuserdata(L, node);
+    } else {
+        lua_pushnil(L);
+    }
 
-    lua_pushcfunction(L, lua_node_search);
-    lua_setfield(L, -2, "xpath");
+    return 1;
 }
 
 int lua_node_search(lua_State* L) {
-    if (!lua_istable(L, 1)) {
-        luaL_error(L, "Expected self to be a table.");
-        return 0;
+    Document* document;
+    xmlNodePtr node = check_node(L, 1, &document);
+    xmlXPathCompExprPtr comp = check_xpath(L, 2);
+
+    xmlXPathObjectPtr obj = evaluate_xpath(L, document, node, comp);
+
+    lua_getiuservalue(L, 1, NODE_OWNER);
+    push_node_set(L, obj ? obj->nodesetval : NULL, -1);
+
+    if (obj) xmlXPathFreeObject(obj);
+
+    return 1;
+}
+
+int lua_xml_xpath(lua_State* L) {
+    Document* document = check_document(L, 1);
+    xmlXPathCompExprPtr comp = check_xpath(L, 2);
+
+    xmlXPathObjectPtr elements = evaluate_xpath(L, document, NULL, comp);
+
+    push_node_set(L, elements ? elements->nodesetval : NULL, 1);
+
+    if (elements) xmlXPathFreeObject(elements);
+    return 1;
+}
+
+enum FieldType {
+    FIELD_STRING,
+    FIELD_NUMBER,
+    FIELD_TIMESTAMP,
+};
+
+typedef struct Field {
+    std::string name;
+    xmlXPathCompExprPtr comp = NULL;
+    int index = 0;
+    std::string attr;
+    FieldType type = FIELD_STRING;
+} Field;
+
+bool read_field_xpath(lua_State* L, int index, Field& field) {
+    XPath* handle = (XPath*) luaL_testudata(L, index, XPATH_METATABLE);
+    if (handle != NULL) {
+        field.comp = handle->comp;
+        return true;
     }
 
-    if (!lua_isstring(L, 2)) {
-        luaL_error(L, "Expected XPath to be a string.");
-        return 0;
+    field.comp = cached_xpath(lua_tostring(L, index));
+    if (field.comp == NULL) {
+        lua_pushfstring(L, "Invalid XPath expression '%s' for field '%s'.", lua_tostring(L, index), field.name.c_str());
+        return false;
     }
 
-    xmlChar* xpath = (xmlChar*) lua_tostring(L, 2);
+    return true;
+}
 
-    lua_getfield(L, 1, "node_ptr");
-    if (!lua_islightuserdata(L, -1)) {
-        luaL_error(L, "Expected 'node_ptr' to be a light userdata.");
-        return 0;
+// Reads the spec at `index`, either an XPath or a table of options.
+bool read_field(lua_State* L, int index, Field& field) {
+    if (lua_isstring(L, index) || luaL_testudata(L, index, XPATH_METATABLE) != NULL)
+        return read_field_xpath(L, index, field);
+
+    if (!lua_istable(L, index)) {
+        lua_pushfstring(L, "Expected table or XPath for field '%s'.", field.name.c_str());
+        return false;
     }
 
-    xmlNodePtr node = (xmlNodePtr)lua_touserdata(L, -1);
+    bool ok = true;
+
+    lua_getfield(L, index, "xpath");
+    if (!lua_isnil(L, -1))
+        ok = read_field_xpath(L, lua_gettop(L), field);
+    if (!ok) {
+        lua_remove(L, -2);
+        return false;
+    }
     lua_pop(L, 1);
 
-    xmlXPathContextPtr ctx = xmlXPathNewContext(node->doc);
-    if (ctx == NULL) {
-        luaL_error(L, "Failed to create XPath context.");
-        return 0;
+    lua_getfield(L, index, "index");
+    if (lua_isinteger(L, -1))
+        field.index = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "attr");
+    if (lua_isstring(L, -1))
+        field.attr = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "type");
+    if (lua_isstring(L, -1)) {
+        const char* type = lua_tostring(L, -1);
+
+        if (strcmp(type, "number") == 0)
+            field.type = FIELD_NUMBER;
+        else if (strcmp(type, "timestamp") == 0)
+            field.type = FIELD_TIMESTAMP;
+        else if (strcmp(type, "string") != 0)
+            ok = false;
     }
+    lua_pop(L, 1);
 
-    if (xmlXPathSetContextNode(node, ctx) != 0) {
-        xmlXPathFreeContext(ctx);
-        luaL_error(L, "Failed to set context node.");
-        return 0;
+    if (!ok) {
+        lua_pushfstring(L, "Unknown type for field '%s'.", field.name.c_str());
+        return false;
     }
 
-    xmlXPathObjectPtr obj = xmlXPathEvalExpression(xpath, ctx);
-    lua_newtable(L);
+    return true;
+}
 
-    if (!obj->nodesetval || obj->nodesetval->nodeNr == 0) {
-        xmlXPathFreeObject(obj);
-        xmlXPathFreeContext(ctx);
-        return 1;
+xmlNodePtr element_child(xmlNodePtr node, int index) {
+    for (xmlNodePtr child = node->children; child; child = child->next) {
+        if (child->type == XML_ELEMENT_NODE && --index == 0)
+            return child;
     }
 
-    for (int i = 0; i < obj->nodesetval->nodeNr; i++) {
-        xmlNodePtr node = obj->nodesetval->nodeTab[i];
-        if (node) {
-            populate_node_table(L, node);
-            lua_rawseti(L, -2, i + 1);
+    return NULL;
+}
+
+xmlNodePtr field_node(Document* document, xmlNodePtr row, const Field& field) {
+    xmlNodePtr node = row;
+
+    if (field.index > 0)
+        node = element_child(node, field.index);
+
+    if (node == NULL || field.comp == NULL)
+        return node;
+
+    document->ctx->node = node;
+    xmlXPathObjectPtr obj = xmlXPathCompiledEval(field.comp, document->ctx);
+
+    node = NULL;
+    if (obj && obj->nodesetval && obj->nodesetval->nodeNr > 0)
+        node = obj->nodesetval->nodeTab[0];
+
+    if (obj) xmlXPathFreeObject(obj);
+    return node;
+}
+
+// Pushes the first number in `value`, e.g. 1.74 for "1.74 GiB" or 1234 for
+// "1,234". Commas are only skipped between digits.
+void push_number(lua_State* L, const char* value) {
+    while (*value && !isdigit((unsigned char) *value)
+        && !((*value == '-' || *value == '.') && isdigit((unsigned char) value[1])))
+        value++;
+
+    std::string number;
+    size_t size = 0;
+    if (value[size] == '-')
+        number += value[size++];
+
+    while (isdigit((unsigned char) value[size]) || value[size] == '.'
+        || (value[size] == ',' && size > 0 && isdigit((unsigned char) value[size - 1]) && isdigit((unsigned char) value[size + 1]))) {
+        if (value[size] != ',')
+            number += value[size];
+        size++;
+    }
+
+    if (number.empty() || lua_stringtonumber(L, number.c_str()) == 0)
+        lua_pushnil(L);
+}
+
+void push_timestamp(lua_State* L, const char* value) {
+    while (isspace((unsigned char) *value))
+        value++;
+
+    char* end;
+    long long epoch = strtoll(value, &end, 10);
+    if (end != value && (*end == '\0' || isspace((unsigned char) *end))) {
+        lua_pushinteger(L, epoch);
+        return;
+    }
+
+    static const char* formats[] = {
+        "%Y-%m-%d %H:%M:%S",
+        "%Y-%m-%d %H:%M",
+        "%Y-%m-%dT%H:%M:%S",
+        "%Y-%m-%d",
+        "%a, %d %b %Y %H:%M:%S",
+    };
+
+    for (const char* format : formats) {
+        struct tm time = {};
+        if (strptime(value, format, &time) != NULL) {
+            lua_pushinteger(L, timegm(&time));
+            return;
+        }
+    }
+
+    lua_pushnil(L);
+}
+
+void push_field(lua_State* L, xmlNodePtr node, const Field& field) {
+    xmlChar* value = field.attr.empty()
+        ? xmlNodeGetContent(node)
+        : xmlGetProp(node, (const xmlChar*) field.attr.c_str());
+
+    if (value == NULL) {
+        lua_pushnil(L);
+        return;
+    }
+
+    switch (field.type) {
+        case FIELD_NUMBER:
+            push_number(L, (const char*) value);
+            break;
+        case FIELD_TIMESTAMP:
+            push_timestamp(L, (const char*) value);
+            break;
+        default:
+            lua_pushstring(L, (const char*) value);
+            break;
+    }
+
+    xmlFree(value);
+}
+
+bool extract(lua_State* L, Document* document, xmlXPathCompExprPtr rows, int spec) {
+    std::vector<Field> fields;
+
+    lua_pushnil(L);
+    while (lua_next(L, spec) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            lua_pop(L, 2);
+            lua_pushstring(L, "Expected field names to be strings.");
+            return false;
         }
+
+        fields.emplace_back();
+        fields.back().name = lua_tostring(L, -2);
+
+        if (!read_field(L, lua_gettop(L), fields.back())) {
+            lua_remove(L, -2);
+            lua_remove(L, -2);
+            return false;
+        }
+
+        lua_pop(L, 1);
     }
 
-    xmlXPathFreeObject(obj);
-    xmlXPathFreeContext(ctx);
+    if (!ensure_context(document)) {
+        lua_pushstring(L, "Failed to create XPath context.");
+        return false;
+    }
+
+    document->ctx->node = NULL;
+    xmlXPathObjectPtr obj = xmlXPathCompiledEval(rows, document->ctx);
+    xmlNodeSetPtr set = obj ? obj->nodesetval : NULL;
+    int count = set ? set->nodeNr : 0;
+
+    // Fields that select the same node, e.g. a link's text and its href,
+    // share one lookup per row.
+    std::vector<size_t> lookup(fields.size());
+    for (size_t f = 0; f < fields.size(); f++) {
+        lookup[f] = f;
+        for (size_t other = 0; other < f; other++) {
+            if (fields[other].index == fields[f].index && fields[other].comp == fields[f].comp) {
+                lookup[f] = other;
+                break;
+            }
+        }
+    }
+
+    std::vector<xmlNodePtr> nodes(fields.size());
+
+    lua_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        lua_createtable(L, 0, fields.size());
+
+        for (size_t f = 0; f < fields.size(); f++) {
+            const Field& field = fields[f];
+
+            xmlNodePtr node = lookup[f] == f ? field_node(document, set->nodeTab[i], field) : nodes[lookup[f]];
+            nodes[f] = node;
+            if (node == NULL)
+                continue;
+
+            push_field(L, node, field);
+            lua_setfield(L, -2, field.name.c_str());
+        }
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    if (obj) xmlXPathFreeObject(obj);
+    return true;
+}
+
+int protected_extract(lua_State* L) {
+    Document* document = (Document*) lua_touserdata(L, 1);
+    xmlXPathCompExprPtr rows = (xmlXPathCompExprPtr) lua_touserdata(L, 2);
+
+    if (!extract(L, document, rows, 3))
+        return lua_error(L);
 
     return 1;
 }
 
-int lua_xml_xpath(lua_State* L) {
-    if (!lua_istable(L, 1)) {
-        luaL_error(L, "Expected self to be a table.");
+int lua_document_extract(lua_State* L) {
+    Document* document = check_document(L, 1);
+    xmlXPathCompExprPtr rows = check_xpath(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    lua_pushcfunction(L, protected_extract);
+    lua_pushlightuserdata(L, document);
+    lua_pushlightuserdata(L, rows);
+    lua_pushvalue(L, 3);
+
+    // The field expressions and `rows` may all come from the cache, so they
+    // are pinned until the rows have been extracted. Extracting runs
+    // protected so the pin is dropped even when it raises.
+    xpath_cache.pinned = true;
+    int status = lua_pcall(L, 3, 1, 0);
+    xpath_cache.pinned = false;
+    trim_xpath_cache();
+
+    if (status != LUA_OK)
+        return lua_error(L);
+
+    return 1;
+}
+
+int lua_compile_xpath(lua_State* L) {
+    const char* xpath = luaL_checkstring(L, 1);
+
+    XPath* handle = (XPath*) lua_newuserdatauv(L, sizeof(XPath), 0);
+    handle->comp = NULL;
+    luaL_setmetatable(L, XPATH_METATABLE);
+
+    handle->comp = compile_xpath(xpath);
+    if (handle->comp == NULL) {
+        luaL_error(L, "Invalid XPath expression '%s'.", xpath);
         return 0;
     }
 
-    if(!lua_isstring(L, 2)) {
-        luaL_error(L, "Expected to XPath to be a string.");
-        return 0;
+    return 1;
+}
+
+int xpath_gc(lua_State* L) {
+    XPath* handle = (XPath*) luaL_checkudata(L, 1, XPATH_METATABLE);
+
+    if (handle->comp != NULL) {
+        xmlXPathFreeCompExpr(handle->comp);
+        handle->comp = NULL;
     }
 
-    xmlChar* xpath = (xmlChar*) lua_tostring(L, 2);
+    return 0;
+}
 
-    lua_getfield(L, 1, "root");
-    if (!lua_islightuserdata(L, -1)) {
-        luaL_error(L, "Expected 'root' to be a light userdata.");
-        return 0;
+void push_document(lua_State* L, htmlDocPtr doc) {
+    Document* document = (Document*) lua_newuserdatauv(L, sizeof(Document), 0);
+    document->doc = doc;
+    document->ctx = NULL;
+    luaL_setmetatable(L, DOCUMENT_METATABLE);
+
+    live_documents++;
+    parsed_documents++;
+}
+
+void load_html_metatables(lua_State* L);
+
+bool push_html_document(lua_State* L, const char* html, size_t size) {
+    load_html_metatables(L);
+    htmlDocPtr doc = htmlReadMemory(html, size, nullptr, nullptr, HTML_PARSE_NOERROR);
+
+    if(doc == nullptr)
+        return false;
+
+    push_document(L, doc);
+    return true;
+}
+
+htmlParserCtxtPtr create_html_push_parser() {
+    htmlParserCtxtPtr parser = htmlCreatePushParserCtxt(nullptr, nullptr, nullptr, 0, nullptr, XML_CHAR_ENCODING_NONE);
+
+    if(parser != nullptr)
+        htmlCtxtUseOptions(parser, HTML_PARSE_NOERROR);
+
+    return parser;
+}
+
+void free_html_push_parser(htmlParserCtxtPtr parser) {
+    if(parser == nullptr)
+        return;
+
+    if(parser->myDoc != nullptr)
+        xmlFreeDoc(parser->myDoc);
+
+    htmlFreeParserCtxt(parser);
+}
+
+void feed_html_push_parser(htmlParserCtxtPtr parser, const char* data, size_t size) {
+    htmlParseChunk(parser, data, size, 0);
+}
+
+// Finishes parsing the chunks fed to `parser`, frees it and pushes the document.
+bool push_html_parser_document(lua_State* L, htmlParserCtxtPtr parser) {
+    htmlParseChunk(parser, nullptr, 0, 1);
+
+    htmlDocPtr doc = parser->myDoc;
+    parser->myDoc = nullptr;
+    htmlFreeParserCtxt(parser);
+
+    if(doc == nullptr)
+        return false;
+
+    push_document(L, doc);
+    return true;
+}
+
+typedef struct ParseJob {
+    const char* html;
+    size_t size;
+    htmlDocPtr doc;
+    double time;
+} ParseJob;
+
+int lua_parse_many(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    size_t count = lua_rawlen(L, 1);
+    size_t threads = std::thread::hardware_concurrency();
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "threads");
+        if (!lua_isnil(L, -1)) {
+            lua_Integer requested = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : 0;
+            if (requested < 1)
+                luaL_argerror(L, 2, "threads must be a positive integer");
+
+            threads = requested;
+        }
+        lua_pop(L, 1);
+    }
+
+    threads = std::max<size_t>(1, std::min(threads, count));
+
+    for (size_t i = 0; i < count; i++) {
+        if (lua_rawgeti(L, 1, i + 1) != LUA_TSTRING)
+            return luaL_error(L, "Expected string for body #%d.", (int) (i + 1));
+        lua_pop(L, 1);
+    }
+
+    // The bodies stay referenced by the argument table, so the workers can
+    // read them without touching the Lua state.
+    std::vector<ParseJob> jobs(count);
+    for (size_t i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        jobs[i].html = lua_tolstring(L, -1, &jobs[i].size);
+        jobs[i].doc = NULL;
+        jobs[i].time = 0;
+        lua_pop(L, 1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next{0};
+
+    auto work = [&jobs, &next, count] {
+        size_t i;
+        while ((i = next++) < count) {
+            auto parse_start = std::chrono::steady_clock::now();
+            jobs[i].doc = htmlReadMemory(jobs[i].html, jobs[i].size, NULL, NULL, HTML_PARSE_NOERROR);
+            jobs[i].time = std::chrono::duration<double>(std::chrono::steady_clock::now() - parse_start).count();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++)
+        workers.emplace_back(work);
+    work();
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    lua_createtable(L, count, 0);
+    lua_createtable(L, 0, 3);
+    lua_createtable(L, count, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].doc != NULL)
+            push_document(L, jobs[i].doc);
+        else
+            lua_pushboolean(L, 0);
+        lua_rawseti(L, -4, i + 1);
+
+        lua_pushnumber(L, jobs[i].time);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_setfield(L, -2, "times");
+    lua_pushnumber(L, total);
+    lua_setfield(L, -2, "total");
+    lua_pushinteger(L, threads);
+    lua_setfield(L, -2, "threads");
+
+    return 2;
+}
+
+bool fetch_html(lua_State* L, int index) {
+    htmlParserCtxtPtr parser = create_html_push_parser();
+    if (parser == NULL) {
+        lua_pushstring(L, "Failed to create HTML parser.");
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    bool ok = stream_request(L, index, [&parser](const char* data, size_t size) {
+        feed_html_push_parser(parser, data, size);
+        return true;
+    }, [&parser] {
+        free_html_push_parser(parser);
+        parser = create_html_push_parser();
+        return parser != NULL;
+    });
+
+    if (!ok || parser == NULL) {
+        free_html_push_parser(parser);
+        return false;
+    }
+
+    if (!push_html_parser_document(L, parser)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, "Failed to parse HTML.");
+        return false;
+    }
+
+    lua_insert(L, -2);
+    lua_pushnumber(L, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    lua_setfield(L, -2, "dom_ready");
+
+    return true;
+}
+
+int lua_fetch_html(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    if (!fetch_html(L, 1))
+        return lua_error(L);
+
+    return 2;
+}
+
+typedef struct Step {
+    std::string name;
+    std::string cls;
+    std::string not_cls;
+    int nth = 0;
+} Step;
+
+typedef struct ScanField {
+    std::string name;
+    std::vector<Step> path;
+    std::string attr;
+    FieldType type = FIELD_STRING;
+} ScanField;
+
+typedef struct OpenElement {
+    std::string name;
+    std::string cls;
+    int nth;
+    std::vector<std::pair<std::string, int>> children;
+} OpenElement;
+
+typedef struct Scanner {
+    lua_State* L;
+    htmlParserCtxtPtr parser;
+    int callback;
+    int results;
+    size_t count;
+    std::string error;
+    bool stopped;
+
+    std::vector<Step> row;
+    std::vector<ScanField> fields;
+
+    std::vector<OpenElement> stack;
+    size_t row_depth;
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    std::vector<std::pair<size_t, size_t>> captures;
+} Scanner;
+
+// Parses a selector like "tbody/tr.success" or "td[2]/a:not(.comments)".
+bool parse_steps(const char* selector, std::vector<Step>& steps) {
+    const char* c = selector;
+
+    while (*c) {
+        Step step;
+
+        while (*c && *c != '/' && *c != '.' && *c != ':' && *c != '[')
+            step.name += tolower((unsigned char) *c++);
+
+        while (*c && *c != '/') {
+            if (*c == '.') {
+                for (c++; *c && *c != '/' && *c != '.' && *c != ':' && *c != '['; c++)
+                    step.cls += *c;
+            } else if (strncmp(c, ":not(.", 6) == 0) {
+                for (c += 6; *c && *c != ')'; c++)
+                    step.not_cls += *c;
+                if (*c != ')')
+                    return false;
+                c++;
+            } else if (*c == '[') {
+                step.nth = strtol(c + 1, (char**) &c, 10);
+                if (*c != ']' || step.nth < 1)
+                    return false;
+                c++;
+            } else {
+                return false;
+            }
+        }
+
+        if (step.name.empty())
+            return false;
+
+        steps.push_back(step);
+        if (*c == '/')
+            c++;
     }
 
-    htmlDocPtr doc = (htmlDocPtr) lua_touserdata(L, -1);
+    return !steps.empty();
+}
+
+bool has_class(const std::string& classes, const std::string& cls) {
+    size_t start = 0;
+
+    while ((start = classes.find(cls, start)) != std::string::npos) {
+        size_t end = start + cls.size();
+        if ((start == 0 || isspace((unsigned char) classes[start - 1]))
+         && (end == classes.size() || isspace((unsigned char) classes[end])))
+            return true;
+
+        start = end;
+    }
+
+    return false;
+}
+
+bool step_matches(const Step& step, const OpenElement& element) {
+    if (step.name != "*" && step.name != element.name)
+        return false;
+
+    if (step.nth > 0 && step.nth != element.nth)
+        return false;
+
+    if (!step.cls.empty() && !has_class(element.cls, step.cls))
+        return false;
+
+    return step.not_cls.empty() || !has_class(element.cls, step.not_cls);
+}
+
+// Whether the elements of the stack in [start, end) are matched by `steps`.
+bool path_matches(const Scanner* scanner, const std::vector<Step>& steps, size_t start, size_t end) {
+    if (end - start != steps.size())
+        return false;
+
+    for (size_t i = 0; i < steps.size(); i++) {
+        if (!step_matches(steps[i], scanner->stack[start + i]))
+            return false;
+    }
+
+    return true;
+}
+
+void emit_record(Scanner* scanner) {
+    lua_State* L = scanner->L;
+
+    if (scanner->callback != 0)
+        lua_pushvalue(L, scanner->callback);
+
+    lua_createtable(L, 0, scanner->fields.size());
+    for (size_t i = 0; i < scanner->fields.size(); i++) {
+        if (!scanner->found[i])
+            continue;
+
+        const char* value = scanner->values[i].c_str();
+        switch (scanner->fields[i].type) {
+            case FIELD_NUMBER:
+                push_number(L, value);
+                break;
+            case FIELD_TIMESTAMP:
+                push_timestamp(L, value);
+                break;
+            default:
+                lua_pushstring(L, value);
+                break;
+        }
+        lua_setfield(L, -2, scanner->fields[i].name.c_str());
+    }
+
+    scanner->count++;
+
+    if (scanner->callback == 0) {
+        lua_rawseti(L, scanner->results, scanner->count);
+        return;
+    }
+
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        scanner->error = lua_tostring(L, -1);
+        scanner->stopped = true;
+    } else if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        scanner->stopped = true;
+    }
     lua_pop(L, 1);
 
-    xmlXPathContextPtr ctx = xmlXPathNewContext(doc); 
-    xmlXPathObjectPtr elements = xmlXPathEvalExpression(xpath, ctx);
+    if (scanner->stopped)
+        xmlStopParser(scanner->parser);
+}
 
-    if (!elements->nodesetval || elements->nodesetval->nodeNr == 0) {
-        xmlXPathFreeObject(elements);
-        xmlXPathFreeContext(ctx);
-        lua_newtable(L);
-        return 1;
+void scan_start_element(void* data, const xmlChar* name, const xmlChar** attributes) {
+    Scanner* scanner = (Scanner*) data;
+    if (scanner->stopped)
+        return;
+
+    OpenElement element;
+    element.name = (const char*) name;
+
+    for (const xmlChar** attr = attributes; attr && *attr; attr += 2) {
+        if (xmlStrcasecmp(attr[0], BAD_CAST "class") == 0 && attr[1])
+            element.cls = (const char*) attr[1];
     }
 
-    lua_newtable(L);
-    for(int i = 0; i < elements->nodesetval->nodeNr; i++) {
-        xmlNodePtr node = elements->nodesetval->nodeTab[i];
-        if(node) {
-            populate_node_table(L, node);
-            lua_rawseti(L, -2, i + 1);
+    element.nth = 1;
+    if (!scanner->stack.empty()) {
+        auto& children = scanner->stack.back().children;
+        auto found = children.begin();
+        while (found != children.end() && found->first != element.name)
+            found++;
+
+        if (found == children.end())
+            children.emplace_back(element.name, 1);
+        else
+            element.nth = ++found->second;
+    }
+
+    scanner->stack.push_back(std::move(element));
+    size_t depth = scanner->stack.size();
+
+    if (scanner->row_depth == 0) {
+        if (depth >= scanner->row.size() && path_matches(scanner, scanner->row, depth - scanner->row.size(), depth)) {
+            scanner->row_depth = depth;
+            std::fill(scanner->found.begin(), scanner->found.end(), false);
+            for (std::string& value : scanner->values)
+                value.clear();
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < scanner->fields.size(); i++) {
+        const ScanField& field = scanner->fields[i];
+        if (scanner->found[i] || !path_matches(scanner, field.path, scanner->row_depth, depth))
+            continue;
+
+        scanner->found[i] = true;
+
+        if (field.attr.empty()) {
+            scanner->captures.emplace_back(i, depth);
+            continue;
+        }
+
+        for (const xmlChar** attr = attributes; attr && *attr; attr += 2) {
+            if (xmlStrcasecmp(attr[0], BAD_CAST field.attr.c_str()) == 0) {
+                scanner->values[i] = attr[1] ? (const char*) attr[1] : "";
+                break;
+            }
         }
     }
-    xmlXPathFreeObject(elements);
-    xmlXPathFreeContext(ctx);
+}
+
+void scan_end_element(void* data, const xmlChar*) {
+    Scanner* scanner = (Scanner*) data;
+    if (scanner->stopped || scanner->stack.empty())
+        return;
+
+    size_t depth = scanner->stack.size();
+
+    while (!scanner->captures.empty() && scanner->captures.back().second == depth)
+        scanner->captures.pop_back();
+
+    scanner->stack.pop_back();
+
+    if (depth == scanner->row_depth) {
+        scanner->row_depth = 0;
+        emit_record(scanner);
+    }
+}
+
+void scan_characters(void* data, const xmlChar* text, int size) {
+    Scanner* scanner = (Scanner*) data;
+
+    for (const auto& [field, depth] : scanner->captures)
+        scanner->values[field].append((const char*) text, size);
+}
+
+bool read_scan_rules(lua_State* L, int index, Scanner& scanner) {
+    lua_getfield(L, index, "row");
+    if (!lua_isstring(L, -1) || !parse_steps(lua_tostring(L, -1), scanner.row)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, "Expected a selector for 'row'.");
+        return false;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "fields");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, "Expected table for 'fields'.");
+        return false;
+    }
+
+    int fields = lua_gettop(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, fields) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            lua_pop(L, 3);
+            lua_pushstring(L, "Expected field names to be strings.");
+            return false;
+        }
+
+        ScanField field;
+        field.name = lua_tostring(L, -2);
+
+        int spec = lua_gettop(L);
+        if (lua_istable(L, spec)) {
+            lua_getfield(L, spec, "attr");
+            if (lua_isstring(L, -1))
+                field.attr = lua_tostring(L, -1);
+            lua_pop(L, 1);
+
+            lua_getfield(L, spec, "type");
+            if (lua_isstring(L, -1)) {
+                if (strcmp(lua_tostring(L, -1), "number") == 0)
+                    field.type = FIELD_NUMBER;
+                else if (strcmp(lua_tostring(L, -1), "timestamp") == 0)
+                    field.type = FIELD_TIMESTAMP;
+            }
+            lua_pop(L, 1);
+
+            lua_getfield(L, spec, "path");
+        } else {
+            lua_pushvalue(L, spec);
+        }
+
+        bool ok = lua_isstring(L, -1) && parse_steps(lua_tostring(L, -1), field.path);
+        lua_pop(L, 2);
+
+        if (!ok) {
+            lua_pop(L, 2);
+            lua_pushfstring(L, "Invalid path for field '%s'.", field.name.c_str());
+            return false;
+        }
+
+        scanner.fields.push_back(field);
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
+htmlParserCtxtPtr create_html_scanner(Scanner* scanner) {
+    htmlSAXHandler handler;
+    memset(&handler, 0, sizeof(handler));
+    handler.initialized = 1;
+    handler.startElement = scan_start_element;
+    handler.endElement = scan_end_element;
+    handler.characters = scan_characters;
+    handler.cdataBlock = scan_characters;
+
+    htmlParserCtxtPtr parser = htmlCreatePushParserCtxt(&handler, scanner, NULL, 0, NULL, XML_CHAR_ENCODING_NONE);
+    if (parser != NULL)
+        htmlCtxtUseOptions(parser, HTML_PARSE_NOERROR);
+
+    return parser;
+}
+
+void reset_scanner(Scanner* scanner) {
+    scanner->stack.clear();
+    scanner->captures.clear();
+    scanner->row_depth = 0;
+
+    // Rows taken from an abandoned response are dropped so a retried or
+    // revalidated request yields the same rows as a fresh one.
+    if (scanner->callback == 0 && scanner->count > 0) {
+        lua_newtable(scanner->L);
+        lua_replace(scanner->L, scanner->results);
+        scanner->count = 0;
+    }
+}
+
+bool scan_html(lua_State* L, int source, int rules, int callback) {
+    Scanner scanner;
+    scanner.L = L;
+    scanner.callback = callback;
+    scanner.count = 0;
+    scanner.stopped = false;
+    scanner.row_depth = 0;
+
+    if (!read_scan_rules(L, rules, scanner))
+        return false;
+
+    scanner.values.resize(scanner.fields.size());
+    scanner.found.resize(scanner.fields.size());
+
+    if (callback == 0)
+        lua_newtable(L);
+    scanner.results = lua_gettop(L);
+
+    scanner.parser = create_html_scanner(&scanner);
+    if (scanner.parser == NULL) {
+        lua_pushstring(L, "Failed to create HTML parser.");
+        return false;
+    }
+
+    auto feed = [&scanner](const char* data, size_t size) {
+        if (!scanner.stopped)
+            feed_html_push_parser(scanner.parser, data, size);
+        return !scanner.stopped;
+    };
+
+    bool ok = true;
+
+    if (lua_isstring(L, source)) {
+        size_t size;
+        const char* html = lua_tolstring(L, source, &size);
+        feed(html, size);
+    } else {
+        ok = stream_request(L, source, feed, [&scanner] {
+            if (scanner.parser->myDoc != NULL)
+                xmlFreeDoc(scanner.parser->myDoc);
+            htmlFreeParserCtxt(scanner.parser);
+            reset_scanner(&scanner);
+            scanner.parser = create_html_scanner(&scanner);
+            return scanner.parser != NULL;
+        });
+
+        if (ok)
+            lua_pop(L, 1);
+    }
+
+    if (scanner.parser != NULL) {
+        if (ok && !scanner.stopped)
+            htmlParseChunk(scanner.parser, NULL, 0, 1);
+
+        if (scanner.parser->myDoc != NULL)
+            xmlFreeDoc(scanner.parser->myDoc);
+        htmlFreeParserCtxt(scanner.parser);
+    }
+
+    if (!ok)
+        return false;
+
+    if (!scanner.error.empty()) {
+        lua_pushstring(L, scanner.error.c_str());
+        return false;
+    }
+
+    if (callback != 0)
+        lua_pushinteger(L, scanner.count);
+
+    return true;
+}
+
+int lua_scan_html(lua_State* L) {
+    if (!lua_isstring(L, 1) && !lua_istable(L, 1))
+        return luaL_error(L, "Expected a string or a request table as the source.");
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    int callback = 0;
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        callback = 3;
+    }
+
+    lua_settop(L, 3);
+
+    if (!scan_html(L, 1, 2, callback))
+        return lua_error(L);
+
+    return 1;
+}
+
+int lua_document_close(lua_State* L) {
+    close_document((Document*) luaL_checkudata(L, 1, DOCUMENT_METATABLE));
+    return 0;
+}
+
+int document_index(lua_State* L) {
+    Document* document = (Document*) luaL_checkudata(L, 1, DOCUMENT_METATABLE);
+    const char* key = luaL_checkstring(L, 2);
+
+    if (strcmp(key, "xpath") == 0) {
+        lua_pushcfunction(L, lua_xml_xpath);
+    } else if (strcmp(key, "extract") == 0) {
+        lua_pushcfunction(L, lua_document_extract);
+    } else if (strcmp(key, "close") == 0) {
+        lua_pushcfunction(L, lua_document_close);
+    } else if (strcmp(key, "root") == 0 && document->doc != NULL) {
+        lua_pushlightuserdata(L, document->doc);
+    } else {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+int lua_html_stats(lua_State* L) {
+    lua_createtable(L, 0, 4);
+
+    lua_pushinteger(L, live_documents);
+    lua_setfield(L, -2, "documents");
+    lua_pushinteger(L, parsed_documents);
+    lua_setfield(L, -2, "parsed");
+    lua_pushinteger(L, xml_bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, compiled_expressions);
+    lua_setfield(L, -2, "compiled");
+
     return 1;
 }
 
@@ -157,30 +1368,72 @@ int lua_parse_html(lua_State* L) {
         return 0;
     }
 
-    const char* html = lua_tostring(L, -1);
-    htmlDocPtr doc = htmlReadMemory(html, strlen(html), nullptr, nullptr, HTML_PARSE_NOERROR);
+    size_t size;
+    const char* html = lua_tolstring(L, -1, &size);
 
-    if(doc == nullptr) {
+    if(!push_html_document(L, html, size)) {
         luaL_error(L, "Failed to parse HTML.");
         return 0;
     }
 
-    lua_newtable(L);
+    return 1;
+}
 
-    lua_pushlightuserdata(L, doc);
-    lua_setfield(L, -2, "root");
+// Also called before pushing documents from other libraries, so responses
+// can be parsed before the html library itself has been loaded.
+void load_html_metatables(lua_State* L) {
+    static std::once_flag memory_setup;
+    std::call_once(memory_setup, [] {
+        xmlMemSetup(xml_free, xml_malloc, xml_realloc, xml_strdup);
+        xmlInitParser();
+    });
 
-    lua_pushcfunction(L, lua_xml_xpath);
-    lua_setfield(L, -2, "xpath");
+    if(!luaL_newmetatable(L, DOCUMENT_METATABLE)) {
+        lua_pop(L, 1);
+        return;
+    }
 
-    return 1;
+    lua_pushcfunction(L, document_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_document_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, lua_document_close);
+    lua_setfield(L, -2, "__close");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, XPATH_METATABLE);
+    lua_pushcfunction(L, xpath_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, NODE_METATABLE);
+    lua_pushcfunction(L, node_index);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
 }
 
 void load_html_library(lua_State* L) {
+    load_html_metatables(L);
+
     lua_newtable(L);
 
     lua_pushcfunction(L, lua_parse_html);
     lua_setfield(L, -2, "parse");
 
+    lua_pushcfunction(L, lua_parse_many);
+    lua_setfield(L, -2, "parse_many");
+
+    lua_pushcfunction(L, lua_fetch_html);
+    lua_setfield(L, -2, "fetch");
+
+    lua_pushcfunction(L, lua_scan_html);
+    lua_setfield(L, -2, "scan");
+
+    lua_pushcfunction(L, lua_compile_xpath);
+    lua_setfield(L, -2, "compile");
+
+    lua_pushcfunction(L, lua_html_stats);
+    lua_setfield(L, -2, "stats");
+
     lua_setglobal(L, "html");
 }
@@ -1,5 +1,8 @@
+#include <cstddef>
+
 extern "C" {
     #include <lua.h>
 }
 
 void load_html_library(lua_State* L);
+bool push_html_document(lua_State* L, const char* html, size_t size);
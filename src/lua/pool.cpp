@@ -0,0 +1,178 @@
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <curl/curl.h>
+}
+
+#include "pool.h"
+
+#define POOL_MAX_IDLE_PER_HOST 8
+
+typedef struct HostPool {
+    std::vector<CURL*> idle;
+    size_t hits = 0;
+    size_t misses = 0;
+} HostPool;
+
+std::mutex pool_mutex;
+std::unordered_map<std::string, HostPool> pools;
+
+CURLSH* share = nullptr;
+std::mutex share_mutexes[CURL_LOCK_DATA_LAST];
+
+void share_lock(CURL*, curl_lock_data data, curl_lock_access, void*) {
+    share_mutexes[data].lock();
+}
+
+void share_unlock(CURL*, curl_lock_data data, void*) {
+    share_mutexes[data].unlock();
+}
+
+CURLSH* get_share() {
+    if(share != nullptr)
+        return share;
+
+    share = curl_share_init();
+    if(share == nullptr)
+        return nullptr;
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    return share;
+}
+
+std::string pool_host_key(const char* url) {
+    std::string key = url;
+
+    size_t start = key.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+
+    size_t end = key.find_first_of("/?#", start);
+    if(end != std::string::npos)
+        key.erase(end);
+
+    return key;
+}
+
+// curl is only initialized once the first transfer needs it, so runs that
+// never touch the network skip curl_global_init entirely.
+std::once_flag curl_initialized;
+bool curl_started = false;
+
+void pool_init() {
+    std::call_once(curl_initialized, [] {
+        curl_global_init(CURL_GLOBAL_ALL);
+        curl_started = true;
+    });
+}
+
+CURL* pool_acquire(const std::string& host) {
+    pool_init();
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    HostPool& pool = pools[host];
+
+    CURL* curl;
+    if(!pool.idle.empty()) {
+        curl = pool.idle.back();
+        pool.idle.pop_back();
+        pool.hits++;
+
+        curl_easy_reset(curl);
+    } else {
+        curl = curl_easy_init();
+        if(curl == nullptr)
+            return nullptr;
+
+        pool.misses++;
+    }
+
+    CURLSH* sh = get_share();
+    if(sh != nullptr)
+        curl_easy_setopt(curl, CURLOPT_SHARE, sh);
+
+    return curl;
+}
+
+void pool_release(const std::string& host, CURL* curl) {
+    if(curl == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    HostPool& pool = pools[host];
+
+    if(pool.idle.size() >= POOL_MAX_IDLE_PER_HOST) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+
+    pool.idle.push_back(curl);
+}
+
+void pool_cleanup() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+
+    for(auto& [host, pool] : pools) {
+        for(CURL* curl : pool.idle)
+            curl_easy_cleanup(curl);
+
+        pool.idle.clear();
+    }
+    pools.clear();
+
+    if(share != nullptr) {
+        curl_share_cleanup(share);
+        share = nullptr;
+    }
+
+    if(curl_started) {
+        curl_global_cleanup();
+        curl_started = false;
+    }
+}
+
+int lua_pool_stats(lua_State* L) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t idle = 0;
+
+    lua_createtable(L, 0, 4);
+
+    lua_createtable(L, 0, pools.size());
+    for(const auto& [host, pool] : pools) {
+        lua_createtable(L, 0, 3);
+
+        lua_pushinteger(L, pool.hits);
+        lua_setfield(L, -2, "hits");
+        lua_pushinteger(L, pool.misses);
+        lua_setfield(L, -2, "misses");
+        lua_pushinteger(L, pool.idle.size());
+        lua_setfield(L, -2, "idle");
+
+        lua_setfield(L, -2, host.c_str());
+
+        hits += pool.hits;
+        misses += pool.misses;
+        idle += pool.idle.size();
+    }
+    lua_setfield(L, -2, "hosts");
+
+    lua_pushinteger(L, hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, idle);
+    lua_setfield(L, -2, "idle");
+
+    return 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+extern "C" {
+    #include <lua.h>
+    #include <curl/curl.h>
+}
+
+void pool_init();
+std::string pool_host_key(const char* url);
+CURL* pool_acquire(const std::string& host);
+void pool_release(const std::string& host, CURL* curl);
+void pool_cleanup();
+int lua_pool_stats(lua_State* L);
@@ -1,189 +1,1537 @@
+#include <new>
+#include <map>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <memory>
+#include <cctype>
 #include <cstring>
+#include <ctime>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <unistd.h>
 
-#include <vector>
-#include <json/json.h>
 
-extern "C" {
-    #include <lua.h>
-    #include <lauxlib.h>
-    #include <lualib.h>
-    #include <curl/curl.h>
-    #include <curl/easy.h>
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+    #include <curl/curl.h>
+    #include <curl/easy.h>
+}
+
+#include "json.h"
+#include "parser.h"
+#include "pool.h"
+#include "limiter.h"
+#include "cache.h"
+#include "cassette.h"
+
+#define RESPONSE_METATABLE "requests.response"
+#define HEADERS_METATABLE "requests.headers"
+#define RESPONSE_MAX_RESERVE (64 * 1024 * 1024)
+
+typedef struct Timing {
+    double namelookup;
+    double connect;
+    double appconnect;
+    double starttransfer;
+    double total;
+    curl_off_t size_download;
+    curl_off_t size_decoded;
+    curl_off_t speed_download;
+    long http_version;
+} Timing;
+
+typedef struct HostStats {
+    size_t requests = 0;
+    size_t failures = 0;
+    double namelookup = 0;
+    double connect = 0;
+    double appconnect = 0;
+    double starttransfer = 0;
+    double total = 0;
+    curl_off_t bytes = 0;
+    curl_off_t decoded_bytes = 0;
+    size_t retries = 0;
+} HostStats;
+
+typedef struct Response {
+    std::string body;
+    std::string header_data;
+    std::string url;
+    const char* cache_status;
+    Timing timing;
+    bool has_timing;
+} Response;
+
+std::mutex stats_mutex;
+std::map<std::string, HostStats> host_stats;
+
+typedef struct Retry {
+    int attempts;
+    double base;
+    double max;
+} Retry;
+
+typedef struct Transport {
+    bool compression;
+    bool http2;
+    std::string record;
+    std::string replay;
+    std::string upstream;
+    Retry retry;
+} Transport;
+
+Transport transport = {
+    .compression = false,
+    .http2 = false,
+    .record = std::string(),
+    .replay = std::string(),
+    .upstream = std::string(),
+    .retry = { .attempts = 3, .base = 0.5, .max = 30 },
+};
+
+// Cores running on worker threads share the transport settings; every
+// request takes its own copy in read_request.
+std::mutex transport_mutex;
+
+std::string cookie_dir;
+std::mutex cookie_mutex;
+
+bool cookie_jar_path(const std::string& name, std::string& path) {
+    if(name.empty() || name[0] == '.')
+        return false;
+
+    for(char c : name) {
+        if(!isalnum((unsigned char) c) && c != '_' && c != '-' && c != '.')
+            return false;
+    }
+
+    path = cookie_dir + "/" + name + ".txt";
+    return true;
+}
+
+std::mutex cassette_mutex;
+std::vector<CassetteEntry> replay_entries;
+std::unordered_map<std::string, std::vector<size_t>> replay_index;
+std::unordered_map<std::string, size_t> replay_cursors;
+
+typedef struct Request {
+    std::string url;
+    std::string method;
+    std::string host;
+    std::string limit_name;
+    std::string body;
+    bool has_body = false;
+    std::string cookie_jar;
+    std::vector<std::pair<std::string, std::string>> header_fields;
+    struct curl_slist* headers = nullptr;
+    std::string response_data;
+    std::string header_data;
+    std::string error;
+    long status_code = 0;
+    bool cache_enabled = false;
+    long long cache_ttl = -1;
+    CacheEntry cached;
+    bool has_cached = false;
+    const char* cache_status = nullptr;
+    bool reserve_body = true;
+    bool compression = false;
+    bool http2 = false;
+    bool performed = false;
+    Retry retry = {};
+    bool retry_any_method = false;
+    Transport transport;
+    int attempt = 0;
+    std::chrono::steady_clock::time_point ready_at;
+    CURLcode result = CURLE_OK;
+    Timing timing = {};
+    CURL* curl = nullptr;
+} Request;
+
+size_t curl_write_function(void* ptr, size_t size, size_t nmemb, Request* request) {
+    size_t total_size = size * nmemb;
+    request->response_data.append((char*) ptr, total_size);
+    request->timing.size_decoded += total_size;
+    return total_size;
+}
+
+typedef struct FileSink {
+    FILE* file;
+    Request* request;
+} FileSink;
+
+size_t curl_file_write_function(void* ptr, size_t size, size_t nmemb, FileSink* sink) {
+    size_t written = fwrite(ptr, size, nmemb, sink->file);
+    sink->request->timing.size_decoded += written * size;
+    return written * size;
+}
+
+typedef struct StreamSink {
+    const std::function<bool(const char*, size_t)>* write;
+    Request* request;
+    bool keep_body;
+    bool stopped;
+} StreamSink;
+
+size_t curl_stream_write_function(void* ptr, size_t size, size_t nmemb, StreamSink* sink) {
+    size_t total_size = size * nmemb;
+
+    sink->request->timing.size_decoded += total_size;
+    if(sink->keep_body)
+        sink->request->response_data.append((char*) ptr, total_size);
+
+    if(!(*sink->write)((const char*) ptr, total_size)) {
+        sink->stopped = true;
+        return 0;
+    }
+
+    return total_size;
+}
+
+size_t curl_header_function(void* ptr, size_t size, size_t nmemb, Request* request) {
+    size_t total_size = size * nmemb;
+    const char* line = (const char*) ptr;
+
+    request->header_data.append(line, total_size);
+
+    if(request->reserve_body && total_size > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+        unsigned long long length = strtoull(line + 15, nullptr, 10);
+        if(length > 0 && length <= RESPONSE_MAX_RESERVE)
+            request->response_data.reserve(length);
+    }
+
+    return total_size;
+}
+
+size_t last_status_line(const std::string& header_data) {
+    size_t start = 0;
+    size_t last = 0;
+
+    while(start < header_data.size()) {
+        if(header_data.compare(start, 5, "HTTP/") == 0)
+            last = start;
+
+        start = header_data.find('\n', start);
+        if(start == std::string::npos)
+            break;
+        start++;
+    }
+
+    return last;
+}
+
+long parse_status_code(const std::string& header_data) {
+    size_t start = last_status_line(header_data);
+    size_t code_start = header_data.find(' ', start);
+
+    if(code_start == std::string::npos)
+        return 0;
+
+    return strtol(header_data.c_str() + code_start + 1, nullptr, 10);
+}
+
+bool header_name_equals(const std::string& a, const char* b, size_t b_size) {
+    if(a.size() != b_size)
+        return false;
+
+    return strncasecmp(a.c_str(), b, b_size) == 0;
+}
+
+std::string find_header(const std::string& header_data, const char* name) {
+    std::string value;
+    size_t name_size = strlen(name);
+    size_t start = 0;
+
+    while(start < header_data.size()) {
+        size_t end = header_data.find('\n', start);
+        if(end == std::string::npos)
+            end = header_data.size();
+
+        size_t colon = header_data.find(':', start);
+        if(colon != std::string::npos && colon < end && colon - start == name_size
+        && strncasecmp(header_data.c_str() + start, name, name_size) == 0) {
+            size_t value_start = header_data.find_first_not_of(" \t", colon + 1);
+            size_t value_end = header_data.find_last_not_of(" \t\r", end - 1);
+
+            if(value_start != std::string::npos && value_end != std::string::npos && value_end >= value_start)
+                value = header_data.substr(value_start, value_end - value_start + 1);
+            else
+                value.clear();
+        }
+
+        start = end + 1;
+    }
+
+    return value;
+}
+
+std::string vary_values(const Request& request, const std::string& vary) {
+    std::string result;
+    std::stringstream names(vary);
+    std::string name;
+
+    while(std::getline(names, name, ',')) {
+        size_t first = name.find_first_not_of(" \t");
+        size_t last = name.find_last_not_of(" \t");
+        if(first == std::string::npos)
+            continue;
+
+        name = name.substr(first, last - first + 1);
+        result += name + "=";
+
+        for(const auto& [key, value] : request.header_fields) {
+            if(header_name_equals(key, name.c_str(), name.size())) {
+                result += value;
+                break;
+            }
+        }
+
+        result += ";";
+    }
+
+    return result;
+}
+
+// Drops every line of the header `name`, e.g. so a cached response never
+// replays a Set-Cookie meant for the request that fetched it.
+std::string remove_header(const std::string& header_data, const char* name) {
+    std::string result;
+    size_t name_size = strlen(name);
+    size_t start = 0;
+
+    while(start < header_data.size()) {
+        size_t end = header_data.find('\n', start);
+        end = end == std::string::npos ? header_data.size() : end + 1;
+
+        size_t colon = header_data.find(':', start);
+        bool matches = colon != std::string::npos && colon < end && colon - start == name_size
+            && strncasecmp(header_data.c_str() + start, name, name_size) == 0;
+
+        if(!matches)
+            result.append(header_data, start, end - start);
+
+        start = end;
+    }
+
+    return result;
+}
+
+// Responses marked no-store or private are never stored, even with an
+// explicit cache.ttl.
+bool response_storable(const std::string& header_data) {
+    std::string cache_control = find_header(header_data, "Cache-Control");
+
+    return strcasestr(cache_control.c_str(), "no-store") == nullptr
+        && strcasestr(cache_control.c_str(), "private") == nullptr;
+}
+
+// Requests with a cookie jar are keyed by it, so a response fetched with
+// one session is never served to another.
+std::string cache_key(const Request& request) {
+    std::string key = request.method + " " + request.url;
+
+    if(!request.cookie_jar.empty())
+        key += " cookies=" + request.cookie_jar;
+
+    return key;
+}
+
+long long response_ttl(const std::string& header_data) {
+    std::string cache_control = find_header(header_data, "Cache-Control");
+
+    if(!cache_control.empty()) {
+        if(strcasestr(cache_control.c_str(), "no-cache"))
+            return 0;
+
+        const char* max_age = strcasestr(cache_control.c_str(), "s-maxage=");
+        if(max_age == nullptr)
+            max_age = strcasestr(cache_control.c_str(), "max-age=");
+
+        if(max_age != nullptr)
+            return strtoll(strchr(max_age, '=') + 1, nullptr, 10);
+    }
+
+    std::string expires = find_header(header_data, "Expires");
+    if(!expires.empty()) {
+        time_t date = curl_getdate(expires.c_str(), nullptr);
+        return date > time(nullptr) ? date - time(nullptr) : 0;
+    }
+
+    if(!find_header(header_data, "ETag").empty()
+    || !find_header(header_data, "Last-Modified").empty())
+        return 0;
+
+    return -1;
+}
+
+bool cache_prepare(Request& request) {
+    if(!request.cache_enabled)
+        return false;
+
+    CacheEntry entry;
+    std::string key = cache_key(request);
+
+    if(!cache_lookup(key, entry) || vary_values(request, entry.vary) != entry.vary_values) {
+        request.cache_status = "miss";
+        return false;
+    }
+
+    if(entry.expires > time(nullptr)) {
+        request.response_data = entry.body;
+        request.header_data = entry.header_data;
+        request.cache_status = "hit";
+        cache_stats.hits++;
+        return true;
+    }
+
+    request.cache_status = "miss";
+    if(entry.etag.empty() && entry.last_modified.empty())
+        return false;
+
+    if(!entry.etag.empty())
+        request.header_fields.emplace_back("If-None-Match", entry.etag);
+    if(!entry.last_modified.empty())
+        request.header_fields.emplace_back("If-Modified-Since", entry.last_modified);
+
+    request.cached = std::move(entry);
+    request.has_cached = true;
+
+    return false;
+}
+
+void cache_complete(Request& request) {
+    if(!request.cache_enabled)
+        return;
+
+    if(request.status_code == 304 && request.has_cached) {
+        CacheEntry& entry = request.cached;
+
+        long long ttl = request.cache_ttl >= 0 ? request.cache_ttl : response_ttl(request.header_data);
+        entry.expires = time(nullptr) + (ttl > 0 ? ttl : 0);
+
+        request.response_data = entry.body;
+        request.header_data = entry.header_data;
+        request.cache_status = "revalidated";
+        cache_stats.revalidations++;
+
+        cache_store(entry);
+        return;
+    }
+
+    cache_stats.misses++;
+
+    if(request.status_code != 200 || !response_storable(request.header_data))
+        return;
+
+    long long ttl = request.cache_ttl;
+    std::string vary = find_header(request.header_data, "Vary");
+
+    if(ttl < 0) {
+        if(vary == "*")
+            return;
+
+        ttl = response_ttl(request.header_data);
+        if(ttl < 0)
+            return;
+    }
+
+    CacheEntry entry;
+    entry.key = cache_key(request);
+    entry.vary = vary;
+    entry.vary_values = vary_values(request, vary);
+    entry.etag = find_header(request.header_data, "ETag");
+    entry.last_modified = find_header(request.header_data, "Last-Modified");
+    entry.expires = time(nullptr) + ttl;
+    entry.header_data = remove_header(request.header_data, "Set-Cookie");
+    entry.body = request.response_data;
+
+    cache_store(entry);
+}
+
+std::string cassette_key(const std::string& method, const std::string& url, const std::string& body_hash) {
+    return method + " " + url + " " + body_hash;
+}
+
+bool load_replay(const std::string& path) {
+    std::vector<CassetteEntry> entries;
+    if(!cassette_load(path, entries))
+        return false;
+
+    std::lock_guard<std::mutex> lock(cassette_mutex);
+
+    replay_entries = std::move(entries);
+    replay_index.clear();
+    replay_cursors.clear();
+
+    for(size_t i = 0; i < replay_entries.size(); i++) {
+        const CassetteEntry& entry = replay_entries[i];
+        replay_index[cassette_key(entry.method, entry.url, entry.body_hash)].push_back(i);
+    }
+
+    return true;
+}
+
+bool transport_replay(Request& request) {
+    if(request.transport.replay.empty())
+        return false;
+
+    std::string key = cassette_key(request.method, request.url, cassette_hash(request.body.data(), request.body.size()));
+
+    std::lock_guard<std::mutex> lock(cassette_mutex);
+
+    auto found = replay_index.find(key);
+    if(found == replay_index.end()) {
+        request.error = "No recorded response for " + request.method + " " + request.url + ".";
+        return true;
+    }
+
+    size_t& cursor = replay_cursors[key];
+    const CassetteEntry& entry = replay_entries[found->second[cursor]];
+    if(cursor + 1 < found->second.size())
+        cursor++;
+
+    request.header_data = entry.header_data;
+    request.response_data = entry.body;
+    request.status_code = parse_status_code(entry.header_data);
+    request.timing.size_decoded = entry.body.size();
+
+    return true;
+}
+
+void transport_record(Request& request) {
+    if(request.transport.record.empty())
+        return;
+
+    CassetteEntry entry;
+    entry.method = request.method;
+    entry.url = request.url;
+    entry.body_hash = cassette_hash(request.body.data(), request.body.size());
+    entry.header_data = request.header_data;
+    entry.body = request.response_data;
+
+    std::lock_guard<std::mutex> lock(cassette_mutex);
+    cassette_append(request.transport.record, entry);
+}
+
+void read_retry(lua_State* L, int index, Retry& retry) {
+    lua_getfield(L, index, "attempts");
+    if(lua_isinteger(L, -1))
+        retry.attempts = std::max(1, (int) lua_tointeger(L, -1));
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "base");
+    if(lua_isnumber(L, -1))
+        retry.base = std::max(0.0, lua_tonumber(L, -1));
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "max");
+    if(lua_isnumber(L, -1))
+        retry.max = std::max(0.0, lua_tonumber(L, -1));
+    lua_pop(L, 1);
+}
+
+bool read_request(lua_State* L, int index, Request& request) {
+    lua_getfield(L, index, "url");
+    if(!lua_isstring(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, "Expected string for 'url' field.");
+        return false;
+    }
+
+    request.url = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    {
+        std::lock_guard<std::mutex> lock(transport_mutex);
+        request.transport = transport;
+    }
+
+    if(!request.transport.upstream.empty()) {
+        size_t scheme = request.url.find("://");
+        size_t path = request.url.find_first_of("/?#", scheme == std::string::npos ? 0 : scheme + 3);
+
+        request.url = request.transport.upstream + (path == std::string::npos ? "/" : request.url.substr(path));
+    }
+
+    request.host = pool_host_key(request.url.c_str());
+    request.limit_name = limiter_host_name(request.host);
+
+    lua_getfield(L, index, "method");
+    if(!lua_isstring(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, "Expected string for 'method' field.");
+        return false;
+    }
+
+    request.method = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    const char* method = request.method.c_str();
+    if (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0) {
+        lua_getfield(L, index, "body");
+        if (!lua_isstring(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushstring(L, "Expected string for 'body' field.");
+            return false;
+        }
+
+        size_t body_size;
+        const char* body = lua_tolstring(L, -1, &body_size);
+        request.body.assign(body, body_size);
+        request.has_body = true;
+        lua_pop(L, 1);
+    }
+
+    lua_getfield(L, index, "headers");
+    if(lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while(lua_next(L, -2)) {
+            if(lua_isstring(L, -2) && lua_isstring(L, -1)) {
+                lua_pushvalue(L, -2);
+                request.header_fields.emplace_back(lua_tostring(L, -1), lua_tostring(L, -2));
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "cookies");
+    if(lua_isstring(L, -1)) {
+        std::string name = lua_tostring(L, -1);
+        lua_pop(L, 1);
+
+        if(!cookie_jar_path(name, request.cookie_jar)) {
+            lua_pushfstring(L, "Invalid cookie jar name '%s'.", name.c_str());
+            return false;
+        }
+    } else {
+        lua_pop(L, 1);
+    }
+
+    request.retry = request.transport.retry;
+    lua_getfield(L, index, "retry");
+    if(lua_istable(L, -1)) {
+        read_retry(L, lua_gettop(L), request.retry);
+        request.retry_any_method = true;
+    } else if(lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        request.retry.attempts = 1;
+    }
+    lua_pop(L, 1);
+
+    request.compression = request.transport.compression;
+    lua_getfield(L, index, "compression");
+    if(lua_isboolean(L, -1))
+        request.compression = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    request.http2 = request.transport.http2;
+    lua_getfield(L, index, "http2");
+    if(lua_isboolean(L, -1))
+        request.http2 = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "cache");
+    request.cache_enabled = request.method == "GET" && !(lua_isboolean(L, -1) && !lua_toboolean(L, -1));
+    if(lua_istable(L, -1)) {
+        lua_getfield(L, -1, "ttl");
+        if(lua_isnumber(L, -1))
+            request.cache_ttl = (long long) lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    return true;
+}
+
+bool setup_request(lua_State* L, Request& request) {
+    CURL* curl = pool_acquire(request.host);
+    if(!curl) {
+        lua_pushstring(L, "Failed to initialize CURL.");
+        return false;
+    }
+
+    request.curl = curl;
+
+    curl_easy_setopt(curl, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+
+    if(request.compression)
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    if(!request.cookie_jar.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(cookie_dir, error);
+
+        curl_easy_setopt(curl, CURLOPT_COOKIEFILE, request.cookie_jar.c_str());
+        curl_easy_setopt(curl, CURLOPT_COOKIEJAR, request.cookie_jar.c_str());
+    }
+
+    if(request.http2) {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    for(const auto& [key, value] : request.header_fields) {
+        std::string header = key + ": " + value;
+        request.headers = curl_slist_append(request.headers, header.c_str());
+    }
+
+    if (request.headers != nullptr) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request.headers);
+    }
+
+    if (request.has_body) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) request.body.size());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.body.data());
+    }
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_function);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &request);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_function);
+    curl_easy_setopt(curl, CURLOPT_WRITEHEADER, &request);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &request);
+
+    return true;
+}
+
+void record_timing(Request& request) {
+    CURL* curl = request.curl;
+    Timing& timing = request.timing;
+
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &timing.namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &timing.connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &timing.appconnect);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &timing.starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &timing.total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &timing.size_download);
+    curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &timing.speed_download);
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &timing.http_version);
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    HostStats& stats = host_stats[request.host];
+
+    stats.requests++;
+    if(request.result != CURLE_OK)
+        stats.failures++;
+
+    stats.namelookup += timing.namelookup;
+    stats.connect += timing.connect;
+    stats.appconnect += timing.appconnect;
+    stats.starttransfer += timing.starttransfer;
+    stats.total += timing.total;
+    stats.bytes += timing.size_download;
+    stats.decoded_bytes += timing.size_decoded;
+}
+
+void finish_request(Request& request) {
+    if(request.curl != nullptr)
+        curl_easy_getinfo(request.curl, CURLINFO_RESPONSE_CODE, &request.status_code);
+
+    if(request.curl != nullptr && request.performed)
+        record_timing(request);
+
+    if(request.curl != nullptr && !request.cookie_jar.empty()) {
+        std::lock_guard<std::mutex> lock(cookie_mutex);
+
+        if(request.performed && request.result == CURLE_OK)
+            curl_easy_setopt(request.curl, CURLOPT_COOKIELIST, "FLUSH");
+        curl_easy_setopt(request.curl, CURLOPT_COOKIELIST, "ALL");
+        curl_easy_setopt(request.curl, CURLOPT_COOKIEJAR, nullptr);
+    }
+
+    if(request.headers != nullptr) {
+        curl_slist_free_all(request.headers);
+        request.headers = nullptr;
+    }
+
+    pool_release(request.host, request.curl);
+    request.curl = nullptr;
+}
+
+bool idempotent_method(const std::string& method) {
+    return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" || method == "DELETE";
+}
+
+bool transient_failure(const Request& request) {
+    // Sending a POST or PATCH again may repeat its effect, so unless the
+    // request asked for retries it is only sent again when the server said
+    // it did not handle it and when to come back.
+    if(!idempotent_method(request.method) && !request.retry_any_method) {
+        return request.result == CURLE_OK && (request.status_code == 429 || request.status_code == 503)
+            && !find_header(request.header_data, "Retry-After").empty();
+    }
+
+    switch(request.result) {
+        case CURLE_OK:
+            return request.status_code == 429 || request.status_code == 502
+                || request.status_code == 503 || request.status_code == 504;
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+double retry_after(const std::string& header_data) {
+    std::string value = find_header(header_data, "Retry-After");
+    if(value.empty())
+        return -1;
+
+    if(isdigit((unsigned char) value[0]))
+        return strtod(value.c_str(), nullptr);
+
+    time_t date = curl_getdate(value.c_str(), nullptr);
+    if(date < 0)
+        return -1;
+
+    return std::max(0.0, difftime(date, time(nullptr)));
+}
+
+// Returns how many seconds to wait before trying the request again, or -1
+// when the attempt should be kept as the result.
+double retry_delay(Request& request) {
+    curl_easy_getinfo(request.curl, CURLINFO_RESPONSE_CODE, &request.status_code);
+
+    if(request.attempt + 1 >= request.retry.attempts || !transient_failure(request))
+        return -1;
+
+    static thread_local std::mt19937 random(std::random_device{}());
+
+    double delay = std::min(request.retry.max, request.retry.base * (1 << std::min(request.attempt, 16)));
+    delay = delay / 2 + std::uniform_real_distribution<double>(0, delay / 2)(random);
+
+    if(request.result == CURLE_OK) {
+        double after = retry_after(request.header_data);
+        if(after > request.retry.max)
+            return -1;
+
+        if(after >= 0) {
+            delay = std::max(delay, after);
+            limiter_pause(request.limit_name, after);
+        }
+    }
+
+    return delay;
+}
+
+void retry_request(Request& request) {
+    record_timing(request);
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        host_stats[request.host].retries++;
+    }
+
+    request.attempt++;
+    request.response_data.clear();
+    request.header_data.clear();
+    request.error.clear();
+    request.status_code = 0;
+    request.result = CURLE_OK;
+    request.timing = {};
+}
+
+// Performs the request, retrying it when it fails transiently. `restart`
+// resets whatever the body was being written to before another attempt.
+void perform_request(Request& request, const std::function<bool()>& restart) {
+    while(true) {
+        limiter_acquire(request.limit_name);
+        request.performed = true;
+        request.result = curl_easy_perform(request.curl);
+        limiter_release(request.limit_name);
+
+        double delay = retry_delay(request);
+        if(delay < 0)
+            return;
+
+        retry_request(request);
+        if(restart && !restart())
+            return;
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+    }
+}
+
+void push_status(lua_State* L, const std::string& header_data, bool code) {
+    size_t start = last_status_line(header_data);
+    size_t end = header_data.find('\n', start);
+    if(end == std::string::npos)
+        end = header_data.size();
+
+    size_t code_start = header_data.find(' ', start);
+    if(code_start == std::string::npos || code_start > end) {
+        if(code)
+            lua_pushinteger(L, 0);
+        else
+            lua_pushliteral(L, "");
+        return;
+    }
+
+    if(code) {
+        lua_pushinteger(L, strtol(header_data.c_str() + code_start + 1, nullptr, 10));
+        return;
+    }
+
+    size_t text_start = header_data.find(' ', code_start + 1);
+    while(end > start && (header_data[end - 1] == '\r' || header_data[end - 1] == ' '))
+        end--;
+
+    if(text_start == std::string::npos || text_start >= end)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, header_data.c_str() + text_start + 1, end - text_start - 1);
+}
+
+void push_headers(lua_State* L, const std::string& header_data) {
+    const char* data = header_data.c_str();
+    size_t start = header_data.find('\n', last_status_line(header_data));
+
+    lua_newtable(L);
+
+    while(start != std::string::npos && start < header_data.size()) {
+        start++;
+
+        size_t end = header_data.find('\n', start);
+        if(end == std::string::npos)
+            end = header_data.size();
+
+        size_t colon = header_data.find(':', start);
+        if(colon != std::string::npos && colon < end) {
+            size_t value_start = colon + 1;
+            size_t value_end = end;
+
+            while(value_start < value_end && (data[value_start] == ' ' || data[value_start] == '\t'))
+                value_start++;
+            while(value_end > value_start && (data[value_end - 1] == '\r' || data[value_end - 1] == ' '))
+                value_end--;
+
+            lua_pushlstring(L, data + start, colon - start);
+            lua_pushlstring(L, data + value_start, value_end - value_start);
+            lua_rawset(L, -3);
+        }
+
+        start = end;
+    }
+
+    luaL_setmetatable(L, HEADERS_METATABLE);
 }
 
-#include "json.h"
+int headers_index(lua_State* L) {
+    const char* key = lua_tostring(L, 2);
+    if(key == nullptr)
+        return 0;
+
+    lua_pushnil(L);
+    while(lua_next(L, 1)) {
+        if(lua_type(L, -2) == LUA_TSTRING && strcasecmp(lua_tostring(L, -2), key) == 0)
+            return 1;
 
-std::vector<std::string> split_string(const char* value, char delim) {
-    std::vector<std::string> result;
-    std::stringstream sstream(value);
-    std::string item;
+        lua_pop(L, 1);
+    }
+
+    return 0;
+}
+
+void push_response(lua_State* L, Request& request) {
+    Response* response = (Response*) lua_newuserdatauv(L, sizeof(Response), 1);
+    new (response) Response();
+
+    response->body = std::move(request.response_data);
+    response->header_data = std::move(request.header_data);
+    response->url = request.url;
+    response->cache_status = request.cache_status;
+    response->timing = request.timing;
+    response->has_timing = request.performed;
+
+    luaL_setmetatable(L, RESPONSE_METATABLE);
+}
 
-    while (std::getline(sstream, item, delim)) {
-        result.push_back(item);
+void set_response_field(lua_State* L, int index, const char* key) {
+    if(lua_getiuservalue(L, index, 1) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, index, 1);
     }
-    return result;
+
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, key);
+    lua_pop(L, 1);
 }
 
-int lua_json_request(lua_State* L) {
-    luaL_checktype(L, 1, LUA_TTABLE);
+const char* response_body(lua_State* L, int index, size_t* size) {
+    Response* response = (Response*) luaL_checkudata(L, index, RESPONSE_METATABLE);
 
-    lua_getfield(L, 1, "data");
-    if(!lua_isstring(L, -1)) {
-        lua_pop(L, -1);
-        return luaL_error(L, "Expected string for 'data' field.");
+    if(lua_getiuservalue(L, index, 1) == LUA_TTABLE) {
+        lua_getfield(L, -1, "data");
+        lua_remove(L, -2);
+
+        if(lua_type(L, -1) == LUA_TSTRING)
+            return lua_tolstring(L, -1, size);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, index);
+    *size = response->body.size();
+    return response->body.data();
+}
+
+int lua_response_json(lua_State* L) {
+    size_t size;
+    const char* data = response_body(L, 1, &size);
+
+    if(!json_decode(L, data, size))
+        return lua_error(L);
+
+    return 1;
+}
+
+int lua_response_html(lua_State* L) {
+    size_t size;
+    const char* data = response_body(L, 1, &size);
+
+    if(!push_html_document(L, data, size))
+        return luaL_error(L, "Failed to parse HTML.");
+
+    return 1;
+}
+
+const char* http_version_name(long version) {
+    switch(version) {
+        case CURL_HTTP_VERSION_1_0:
+            return "1.0";
+        case CURL_HTTP_VERSION_1_1:
+            return "1.1";
+        case CURL_HTTP_VERSION_2_0:
+            return "2";
+        case CURL_HTTP_VERSION_3:
+            return "3";
+        default:
+            return "";
     }
+}
+
+int response_index(lua_State* L) {
+    Response* response = (Response*) luaL_checkudata(L, 1, RESPONSE_METATABLE);
 
-    const char* data = lua_tostring(L, -1);
+    if(lua_getiuservalue(L, 1, 1) == LUA_TTABLE) {
+        lua_pushvalue(L, 2);
+        if(lua_rawget(L, -2) != LUA_TNIL)
+            return 1;
+        lua_pop(L, 1);
+    }
     lua_pop(L, 1);
-    Json::CharReaderBuilder reader;
-    std::istringstream isstream(data);
-    std::string errors;
-    Json::Value result;
 
-    if (Json::parseFromStream(reader, isstream, &result, &errors)) {
-        json_to_lua_table(L, result);
+    const char* key = lua_tostring(L, 2);
+    if(key == nullptr)
+        return 0;
+
+    if(strcmp(key, "data") == 0) {
+        lua_pushlstring(L, response->body.data(), response->body.size());
+        set_response_field(L, 1, key);
+
+        std::string().swap(response->body);
+    } else if(strcmp(key, "headers") == 0) {
+        push_headers(L, response->header_data);
+        set_response_field(L, 1, key);
+    } else if(strcmp(key, "status_code") == 0) {
+        push_status(L, response->header_data, true);
+    } else if(strcmp(key, "status") == 0) {
+        push_status(L, response->header_data, false);
+    } else if(strcmp(key, "url") == 0) {
+        lua_pushstring(L, response->url.c_str());
+    } else if(strcmp(key, "json") == 0) {
+        lua_pushcfunction(L, lua_response_json);
+    } else if(strcmp(key, "html") == 0) {
+        lua_pushcfunction(L, lua_response_html);
+    } else if(strcmp(key, "timing") == 0 && response->has_timing) {
+        const Timing& timing = response->timing;
+
+        lua_createtable(L, 0, 9);
+        lua_pushnumber(L, timing.namelookup);
+        lua_setfield(L, -2, "namelookup");
+        lua_pushnumber(L, timing.connect);
+        lua_setfield(L, -2, "connect");
+        lua_pushnumber(L, timing.appconnect);
+        lua_setfield(L, -2, "appconnect");
+        lua_pushnumber(L, timing.starttransfer);
+        lua_setfield(L, -2, "starttransfer");
+        lua_pushnumber(L, timing.total);
+        lua_setfield(L, -2, "total");
+        lua_pushinteger(L, timing.size_download);
+        lua_setfield(L, -2, "size_download");
+        lua_pushinteger(L, timing.size_decoded);
+        lua_setfield(L, -2, "size_decoded");
+        lua_pushinteger(L, timing.speed_download);
+        lua_setfield(L, -2, "speed");
+        lua_pushstring(L, http_version_name(timing.http_version));
+        lua_setfield(L, -2, "http_version");
+        set_response_field(L, 1, key);
+    } else if(strcmp(key, "cache") == 0 && response->cache_status != nullptr) {
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, response->cache_status);
+        lua_setfield(L, -2, "status");
+        set_response_field(L, 1, key);
     } else {
-        return luaL_error(L, "Failed to parse JSON: %s", errors.c_str());
+        return 0;
     }
 
     return 1;
 }
 
-size_t curl_write_function(void* ptr, size_t size, size_t nmemb, std::string* data) {
-    size_t total_size = size * nmemb;
-    data->append((char*) ptr, total_size);
-    return total_size;
+int response_newindex(lua_State* L) {
+    luaL_checkudata(L, 1, RESPONSE_METATABLE);
+    const char* key = luaL_checkstring(L, 2);
+
+    lua_settop(L, 3);
+    set_response_field(L, 1, key);
+
+    return 0;
+}
+
+int response_gc(lua_State* L) {
+    Response* response = (Response*) luaL_checkudata(L, 1, RESPONSE_METATABLE);
+    response->~Response();
+
+    return 0;
+}
+
+bool make_request(lua_State* L, int index) {
+    Request request;
+
+    if(!read_request(L, index, request))
+        return false;
+
+    if(cache_prepare(request)) {
+        push_response(L, request);
+        return true;
+    }
+
+    if(transport_replay(request)) {
+        if(!request.error.empty()) {
+            lua_pushstring(L, request.error.c_str());
+            return false;
+        }
+
+        push_response(L, request);
+        return true;
+    }
+
+    if(!setup_request(L, request)) {
+        finish_request(request);
+        return false;
+    }
+
+    perform_request(request, nullptr);
+    finish_request(request);
+
+    CURLcode response = request.result;
+    if(response != CURLE_OK) {
+        lua_pushfstring(L, "CURL request failed: %s", curl_easy_strerror(response));
+        return false;
+    }
+
+    transport_record(request);
+    cache_complete(request);
+    push_response(L, request);
+    return true;
 }
 
 int lua_make_request(lua_State* L) {
     luaL_checktype(L, 1, LUA_TTABLE);
 
-    lua_getfield(L, 1, "url");
-    if(!lua_isstring(L, -1)) {
+    if(!make_request(L, 1))
+        return lua_error(L);
+
+    return 1;
+}
+
+bool batch_request(lua_State* L, int index, int concurrency) {
+    size_t count = lua_rawlen(L, index);
+    std::vector<Request> requests(count);
+
+    for(size_t i = 0; i < count; i++) {
+        lua_rawgeti(L, index, i + 1);
+        if(!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushfstring(L, "Expected table for request #%d.", (int)(i + 1));
+            return false;
+        }
+
+        lua_getfield(L, -1, "method");
+        if(lua_isnil(L, -1)) {
+            lua_pushstring(L, "GET");
+            lua_setfield(L, -3, "method");
+        }
+        lua_pop(L, 1);
+
+        bool ok = read_request(L, lua_gettop(L), requests[i]);
+        if(!ok) {
+            lua_remove(L, -2);
+            return false;
+        }
         lua_pop(L, 1);
-        return luaL_error(L, "Expected string for 'url' field.");
     }
 
-    const char* url = lua_tostring(L, -1);
-    lua_pop(L, 1);
+    CURLM* multi = curl_multi_init();
+    if(!multi) {
+        lua_pushstring(L, "Failed to initialize CURL multi handle.");
+        return false;
+    }
 
-    lua_getfield(L, 1, "method");
-    if(!lua_isstring(L, -1)) {
-        lua_pop(L, 1);
-        return luaL_error(L, "Expected string for 'method' field.");
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    // Requests answered by the cache or a cassette are done before anything
+    // is queued, so a request the limiter puts back is not looked up again.
+    std::deque<size_t> pending;
+    size_t done = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(cache_prepare(requests[i]) || transport_replay(requests[i]))
+            done++;
+        else
+            pending.push_back(i);
     }
 
-    const char* method = lua_tostring(L, -1);
-    lua_pop(L, 1);
+    int active = 0;
 
-    CURL* curl;
-    CURLcode response;
+    while(done < count) {
+        // How long to sleep when nothing is in flight: until the next retry
+        // is due or a host's token bucket refills.
+        double wait = 1;
+        size_t waiting = pending.size();
 
-    curl = curl_easy_init();
+        for(size_t n = 0; n < waiting && active < concurrency; n++) {
+            size_t i = pending.front();
+            pending.pop_front();
+            Request& request = requests[i];
 
-    if(!curl)
-        return luaL_error(L, "Failed to initialize CURL.");
+            double delay = std::chrono::duration<double>(request.ready_at - std::chrono::steady_clock::now()).count();
+            if(delay <= 0)
+                delay = limiter_try_acquire(request.limit_name);
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
-    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+            if(delay != 0) {
+                wait = std::min(wait, delay > 0 ? delay : 0.05);
+                pending.push_back(i);
+                continue;
+            }
 
-    lua_getfield(L, 1, "headers");
-    if(lua_istable(L, -1)) {
-        struct curl_slist *headers = nullptr;
+            if(request.curl == nullptr) {
+                bool ok = setup_request(L, request);
+                if(!ok) {
+                    request.error = lua_tostring(L, -1);
+                    lua_pop(L, 1);
+                }
+
+                if(!ok) {
+                    limiter_release(request.limit_name);
+                    finish_request(request);
+                    done++;
+                    continue;
+                }
+            }
 
-        lua_pushnil(L);
-        while(lua_next(L, -2)) {
-            if(lua_isstring(L, -2) && lua_isstring(L, -1)) {
-                std::string header = std::string(lua_tostring(L, -2)) + ": " + lua_tostring(L, -1);
-                headers = curl_slist_append(headers, header.c_str());
+            request.performed = true;
+            curl_multi_add_handle(multi, request.curl);
+            active++;
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg* message;
+        int queued;
+        while((message = curl_multi_info_read(multi, &queued))) {
+            if(message->msg != CURLMSG_DONE)
+                continue;
+
+            Request* request;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**) &request);
+
+            request->result = message->data.result;
+            curl_multi_remove_handle(multi, request->curl);
+            limiter_release(request->limit_name);
+            active--;
+
+            double delay = retry_delay(*request);
+            if(delay >= 0) {
+                retry_request(*request);
+                request->ready_at = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(delay));
+                pending.push_back(request - requests.data());
+                continue;
             }
-            lua_pop(L, 1);
+
+            if(request->result != CURLE_OK)
+                request->error = std::string("CURL request failed: ") + curl_easy_strerror(request->result);
+
+            finish_request(*request);
+            if(request->error.empty()) {
+                transport_record(*request);
+                cache_complete(*request);
+            }
+            done++;
         }
 
-        if (headers != nullptr) {
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        } 
+        if(done == count)
+            break;
+
+        if(active > 0)
+            curl_multi_poll(multi, nullptr, 0, std::max(1, std::min(1000, (int) (wait * 1000))), nullptr);
+        else if(!pending.empty())
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
     }
-    lua_pop(L, 1);
 
-    if (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0) {
-        lua_getfield(L, 1, "body");
-        if (!lua_isstring(L, -1)) {
-            lua_pop(L, 1);
-            return luaL_error(L, "Expected string for 'body' field.");
+    curl_multi_cleanup(multi);
+
+    lua_createtable(L, count, 0);
+    for(size_t i = 0; i < count; i++) {
+        Request& request = requests[i];
+
+        if(request.error.empty()) {
+            push_response(L, request);
+        } else {
+            lua_createtable(L, 0, 2);
+            lua_pushstring(L, request.url.c_str());
+            lua_setfield(L, -2, "url");
+            lua_pushstring(L, request.error.c_str());
+            lua_setfield(L, -2, "error");
         }
 
-        const char* body = lua_tostring(L, -1);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return true;
+}
+
+int lua_batch_request(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    int concurrency = 8;
+    if(lua_istable(L, 2)) {
+        lua_getfield(L, 2, "concurrency");
+        if(lua_isinteger(L, -1))
+            concurrency = lua_tointeger(L, -1);
         lua_pop(L, 1);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
     }
 
-    std::string response_data;
-    std::string header_data;
+    if(concurrency < 1)
+        return luaL_error(L, "Expected 'concurrency' to be at least 1.");
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_function);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_data);
-    curl_easy_setopt(curl, CURLOPT_WRITEHEADER, &header_data);
+    if(!batch_request(L, 1, concurrency))
+        return lua_error(L);
 
-    response = curl_easy_perform(curl);
-    if(response != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        return luaL_error(L, "CURL request failed: %s", curl_easy_strerror(response));
+    return 1;
+}
+
+bool download_request(lua_State* L, int index) {
+    Request request;
+
+    lua_getfield(L, index, "method");
+    if(lua_isnil(L, -1)) {
+        lua_pushstring(L, "GET");
+        lua_setfield(L, index, "method");
     }
+    lua_pop(L, 1);
 
-    std::vector<std::string> headers_list = split_string(header_data.c_str(), '\n');
-    std::vector<std::string> data_line = split_string(headers_list[0].c_str(), ' ');
+    lua_getfield(L, index, "path");
+    if(!lua_isstring(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, "Expected string for 'path' field.");
+        return false;
+    }
 
-    curl_easy_cleanup(curl);
+    std::string path = lua_tostring(L, -1);
+    std::string temp_path = path + ".part";
+    lua_pop(L, 1);
 
-    lua_createtable(L, 0, 5);
+    if(!read_request(L, index, request))
+        return false;
 
-    lua_pushstring(L, response_data.c_str());
-    lua_setfield(L, -2, "data");
+    request.cache_enabled = false;
+    request.reserve_body = false;
 
-    lua_newtable(L);
-    for(int i = 1; i < headers_list.size(); i++) {
-        std::string line = headers_list[i];
+    FileSink sink = { fopen(temp_path.c_str(), "wb"), &request };
+    if(sink.file == nullptr) {
+        lua_pushfstring(L, "Failed to open '%s' for writing.", temp_path.c_str());
+        return false;
+    }
 
-        if(line.length() < 3)
-            continue;
+    if(transport_replay(request)) {
+        if(!request.error.empty()) {
+            fclose(sink.file);
+            remove(temp_path.c_str());
+            lua_pushstring(L, request.error.c_str());
+            return false;
+        }
+
+        fwrite(request.response_data.data(), 1, request.response_data.size(), sink.file);
+        std::string().swap(request.response_data);
+    } else {
+        if(!setup_request(L, request)) {
+            fclose(sink.file);
+            remove(temp_path.c_str());
+            finish_request(request);
+            return false;
+        }
 
-        size_t key_size = line.find(": ") + 1;
-        size_t value_size = line.size() - key_size;
+        curl_easy_setopt(request.curl, CURLOPT_WRITEFUNCTION, curl_file_write_function);
+        curl_easy_setopt(request.curl, CURLOPT_WRITEDATA, &sink);
+
+        perform_request(request, [&sink] {
+            fflush(sink.file);
+            rewind(sink.file);
+            return ftruncate(fileno(sink.file), 0) == 0;
+        });
+        finish_request(request);
+
+        if(request.result != CURLE_OK) {
+            fclose(sink.file);
+            remove(temp_path.c_str());
+            lua_pushfstring(L, "CURL request failed: %s", curl_easy_strerror(request.result));
+            return false;
+        }
+    }
 
-        char* key = (char*) calloc(1, key_size);
-        char* value = (char*) calloc(1, value_size);
-        
-        memcpy(key, line.c_str(), key_size - 1);
-        memcpy(value, line.c_str() + key_size + 1, value_size - 1);
+    bool closed = fclose(sink.file) == 0;
+
+    if(request.status_code < 200 || request.status_code >= 300) {
+        remove(temp_path.c_str());
+        lua_pushfstring(L, "Download failed with status %d.", (int) request.status_code);
+        return false;
+    }
 
-        lua_pushstring(L, value);
-        lua_setfield(L, -2, key);
+    if(!closed || rename(temp_path.c_str(), path.c_str()) != 0) {
+        remove(temp_path.c_str());
+        lua_pushfstring(L, "Failed to write '%s'.", path.c_str());
+        return false;
+    }
 
-        free(key);
-        free(value);
+    if(!request.transport.record.empty() && request.performed) {
+        std::ifstream file(path, std::ios::binary);
+        request.response_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        transport_record(request);
     }
 
-    lua_setfield(L, -2, "headers");
-    lua_pushstring(L, url);
+    lua_createtable(L, 0, 6);
+    lua_pushstring(L, path.c_str());
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, request.url.c_str());
     lua_setfield(L, -2, "url");
-    lua_pushinteger(L, std::stoi(data_line[1]));
+    lua_pushinteger(L, request.status_code);
     lua_setfield(L, -2, "status_code");
-    std::string status = data_line[2];
-    lua_pushstring(L, status.erase(status.length() - 1, 1).c_str());
-    lua_setfield(L, -2, "status");
-    lua_pushcfunction(L, lua_json_request);
-    lua_setfield(L, -2, "json");
+    lua_pushinteger(L, request.timing.size_decoded);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, request.timing.total);
+    lua_setfield(L, -2, "time");
+    lua_pushinteger(L, request.timing.speed_download);
+    lua_setfield(L, -2, "speed");
+
+    return true;
+}
+
+int lua_download_request(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    if(!download_request(L, 1))
+        return lua_error(L);
 
     return 1;
 }
 
+// Writes the body of the request at `index` to `write` as it arrives.
+// `write` can return false to stop the transfer early. Pushes a table
+// describing the transfer, or the error.
+bool stream_request(lua_State* L, int index, const std::function<bool(const char*, size_t)>& write, const std::function<bool()>& restart) {
+    Request request;
+
+    lua_getfield(L, index, "method");
+    if(lua_isnil(L, -1)) {
+        lua_pushstring(L, "GET");
+        lua_setfield(L, index, "method");
+    }
+    lua_pop(L, 1);
+
+    if(!read_request(L, index, request))
+        return false;
+
+    if(cache_prepare(request) || transport_replay(request)) {
+        if(!request.error.empty()) {
+            lua_pushstring(L, request.error.c_str());
+            return false;
+        }
+
+        request.status_code = parse_status_code(request.header_data);
+        write(request.response_data.data(), request.response_data.size());
+    } else {
+        request.reserve_body = false;
+
+        // The chunks are also kept for the cache and the cassette, the same
+        // way requests.make would store them.
+        StreamSink sink = { &write, &request, request.cache_enabled || !request.transport.record.empty(), false };
+
+        if(!setup_request(L, request)) {
+            finish_request(request);
+            return false;
+        }
+
+        curl_easy_setopt(request.curl, CURLOPT_WRITEFUNCTION, curl_stream_write_function);
+        curl_easy_setopt(request.curl, CURLOPT_WRITEDATA, &sink);
+
+        perform_request(request, restart);
+        finish_request(request);
+
+        if(request.result != CURLE_OK && !(sink.stopped && request.result == CURLE_WRITE_ERROR)) {
+            lua_pushfstring(L, "CURL request failed: %s", curl_easy_strerror(request.result));
+            return false;
+        }
+
+        if(!sink.stopped) {
+            transport_record(request);
+            cache_complete(request);
+        }
+
+        // The body of a 304 was empty, so the consumer starts over with the
+        // cached body and sees the cached status.
+        if(!sink.stopped && request.cache_status != nullptr && strcmp(request.cache_status, "revalidated") == 0) {
+            request.status_code = parse_status_code(request.header_data);
+
+            if(restart())
+                write(request.response_data.data(), request.response_data.size());
+        }
+    }
+
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, request.url.c_str());
+    lua_setfield(L, -2, "url");
+    lua_pushinteger(L, request.status_code);
+    lua_setfield(L, -2, "status_code");
+    lua_pushinteger(L, request.timing.size_decoded);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, request.timing.total);
+    lua_setfield(L, -2, "time");
+
+    return true;
+}
+
 int lua_get_request(lua_State* L) {
     luaL_checktype(L, 1, LUA_TTABLE);
 
@@ -309,8 +1657,237 @@ int lua_url_encode(lua_State* L) {
     return 1;
 }
 
+void set_request_record(const std::string& path) {
+    std::lock_guard<std::mutex> lock(transport_mutex);
+    transport.record = path;
+}
+
+bool set_request_replay(const std::string& path) {
+    if(!path.empty() && !load_replay(path))
+        return false;
+
+    std::lock_guard<std::mutex> lock(transport_mutex);
+    transport.replay = path;
+    return true;
+}
+
+void set_request_upstream(const std::string& url) {
+    std::lock_guard<std::mutex> lock(transport_mutex);
+    transport.upstream = url;
+
+    while(!transport.upstream.empty() && transport.upstream.back() == '/')
+        transport.upstream.pop_back();
+}
+
+HostLimit read_limit(lua_State* L, int index) {
+    HostLimit limit;
+    if(!lua_istable(L, index))
+        return limit;
+
+    lua_getfield(L, index, "rate");
+    if(lua_isnumber(L, -1))
+        limit.rate = std::max(0.0, lua_tonumber(L, -1));
+    lua_pop(L, 1);
+
+    limit.burst = std::max(1.0, limit.rate);
+    lua_getfield(L, index, "burst");
+    if(lua_isnumber(L, -1))
+        limit.burst = std::max(1.0, lua_tonumber(L, -1));
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "concurrency");
+    if(lua_isinteger(L, -1))
+        limit.concurrency = std::max(0, (int) lua_tointeger(L, -1));
+    lua_pop(L, 1);
+
+    return limit;
+}
+
+int lua_configure_requests(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    bool compression, http2;
+    Retry retry;
+    {
+        std::lock_guard<std::mutex> lock(transport_mutex);
+        compression = transport.compression;
+        http2 = transport.http2;
+        retry = transport.retry;
+    }
+
+    lua_getfield(L, 1, "compression");
+    if(lua_isboolean(L, -1))
+        compression = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "http2");
+    if(lua_isboolean(L, -1))
+        http2 = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "retry");
+    if(lua_istable(L, -1))
+        read_retry(L, lua_gettop(L), retry);
+    else if(lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+        retry.attempts = 1;
+    lua_pop(L, 1);
+
+    {
+        std::lock_guard<std::mutex> lock(transport_mutex);
+        transport.compression = compression;
+        transport.http2 = http2;
+        transport.retry = retry;
+    }
+
+    lua_getfield(L, 1, "limits");
+    if(lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while(lua_next(L, -2) != 0) {
+            if(lua_type(L, -2) == LUA_TSTRING)
+                limiter_set(lua_tostring(L, -2), read_limit(L, lua_gettop(L)));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "record");
+    if(lua_isstring(L, -1))
+        set_request_record(lua_tostring(L, -1));
+    else if(lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+        set_request_record("");
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "upstream");
+    if(lua_isstring(L, -1))
+        set_request_upstream(lua_tostring(L, -1));
+    else if(lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+        set_request_upstream("");
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "replay");
+    if(lua_isstring(L, -1)) {
+        if(!set_request_replay(lua_tostring(L, -1)))
+            return luaL_error(L, "Failed to load cassette '%s'.", lua_tostring(L, -1));
+    } else if(lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        set_request_replay("");
+    }
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+int lua_request_stats(lua_State* L) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+
+    lua_createtable(L, 0, host_stats.size());
+    for(const auto& [host, stats] : host_stats) {
+        lua_createtable(L, 0, 11);
+
+        lua_pushinteger(L, stats.requests);
+        lua_setfield(L, -2, "requests");
+        lua_pushinteger(L, stats.failures);
+        lua_setfield(L, -2, "failures");
+        lua_pushinteger(L, stats.retries);
+        lua_setfield(L, -2, "retries");
+        lua_pushinteger(L, stats.bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushinteger(L, stats.decoded_bytes);
+        lua_setfield(L, -2, "decoded_bytes");
+        lua_pushnumber(L, stats.namelookup);
+        lua_setfield(L, -2, "namelookup");
+        lua_pushnumber(L, stats.connect);
+        lua_setfield(L, -2, "connect");
+        lua_pushnumber(L, stats.appconnect);
+        lua_setfield(L, -2, "appconnect");
+        lua_pushnumber(L, stats.starttransfer);
+        lua_setfield(L, -2, "starttransfer");
+        lua_pushnumber(L, stats.total);
+        lua_setfield(L, -2, "total");
+        lua_pushnumber(L, stats.total > 0 ? stats.bytes / stats.total : 0);
+        lua_setfield(L, -2, "speed");
+
+        lua_setfield(L, -2, host.c_str());
+    }
+
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, cache_stats.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, cache_stats.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, cache_stats.revalidations);
+    lua_setfield(L, -2, "revalidations");
+
+    return 2;
+}
+
+void print_request_stats(FILE* file) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+
+    if(host_stats.empty())
+        return;
+
+    fprintf(file, "%-40s %8s %8s %8s %10s %10s %10s %10s %10s %12s %12s\n",
+            "host", "requests", "failures", "retries", "dns", "connect", "tls", "ttfb", "total", "bytes", "decoded");
+
+    for(const auto& [host, stats] : host_stats) {
+        double count = stats.requests > 0 ? stats.requests : 1;
+
+        fprintf(file, "%-40s %8zu %8zu %8zu %9.1fms %9.1fms %9.1fms %9.1fms %9.1fms %12lld %12lld\n",
+                host.c_str(), stats.requests, stats.failures, stats.retries,
+                stats.namelookup / count * 1000,
+                stats.connect / count * 1000,
+                stats.appconnect / count * 1000,
+                stats.starttransfer / count * 1000,
+                stats.total / count * 1000,
+                (long long) stats.bytes,
+                (long long) stats.decoded_bytes);
+    }
+}
+
+int lua_clear_cache(lua_State*) {
+    cache_clear();
+    return 0;
+}
+
+void set_request_cache_dir(const std::string& dir) {
+    cache_set_dir(dir);
+}
+
+void set_request_cookie_dir(const std::string& dir) {
+    cookie_dir = dir;
+}
+
+int lua_clear_cookies(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+    std::string path;
+
+    if(!cookie_jar_path(name, path))
+        return luaL_error(L, "Invalid cookie jar name '%s'.", name);
+
+    std::lock_guard<std::mutex> lock(cookie_mutex);
+    remove(path.c_str());
+
+    return 0;
+}
+
 void load_request_library(lua_State* L) {
-    lua_createtable(L, 0, 6);
+    pool_init();
+
+    luaL_newmetatable(L, RESPONSE_METATABLE);
+    lua_pushcfunction(L, response_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, response_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, response_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, HEADERS_METATABLE);
+    lua_pushcfunction(L, headers_index);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 15);
     lua_pushcfunction(L, lua_make_request);
     lua_setfield(L, -2, "make");
     lua_pushcfunction(L, lua_post_request);
@@ -327,5 +1904,23 @@ void load_request_library(lua_State* L) {
     lua_setfield(L, -2, "url_encode");
     lua_pushcfunction(L, lua_url_decode);
     lua_setfield(L, -2, "url_decode");
+    lua_pushcfunction(L, lua_download_request);
+    lua_setfield(L, -2, "download");
+    lua_pushcfunction(L, lua_batch_request);
+    lua_setfield(L, -2, "batch");
+    lua_pushcfunction(L, lua_pool_stats);
+    lua_setfield(L, -2, "pool_stats");
+    lua_pushcfunction(L, lua_request_stats);
+    lua_setfield(L, -2, "stats");
+    lua_pushcfunction(L, lua_configure_requests);
+    lua_setfield(L, -2, "configure");
+    lua_pushcfunction(L, lua_clear_cache);
+    lua_setfield(L, -2, "clear_cache");
+    lua_pushcfunction(L, lua_clear_cookies);
+    lua_setfield(L, -2, "clear_cookies");
     lua_setglobal(L, "requests");
 }
+
+void unload_request_library() {
+    pool_cleanup();
+}
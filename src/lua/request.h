@@ -1,11 +1,29 @@
+#include <cstdio>
+#include <string>
+#include <functional>
+
 extern "C" {
     #include <lua.h>
 }
 
 void load_request_library(lua_State* L);
+void unload_request_library();
+void set_request_cache_dir(const std::string& dir);
+void set_request_cookie_dir(const std::string& dir);
+void print_request_stats(FILE* file);
+void set_request_record(const std::string& path);
+bool set_request_replay(const std::string& path);
+void set_request_upstream(const std::string& url);
+bool stream_request(lua_State* L, int index, const std::function<bool(const char*, size_t)>& write, const std::function<bool()>& restart);
+int lua_batch_request(lua_State* L);
+int lua_clear_cache(lua_State* L);
+int lua_clear_cookies(lua_State* L);
+int lua_configure_requests(lua_State* L);
 int lua_delete_request(lua_State* L);
+int lua_download_request(lua_State* L);
 int lua_get_request(lua_State* L);
 int lua_make_request(lua_State* L);
 int lua_patch_request(lua_State* L);
 int lua_post_request(lua_State* L);
 int lua_put_request(lua_State* L);
+int lua_request_stats(lua_State* L);
@@ -0,0 +1,406 @@
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+}
+
+#include "search.h"
+#include "json.h"
+#include "bytecode.h"
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct SearchMessage {
+    std::string core;
+    std::string result;
+    std::string error;
+    bool done = false;
+    size_t results = 0;
+    double time = 0;
+} SearchMessage;
+
+typedef struct SearchQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<SearchMessage> messages;
+} SearchQueue;
+
+typedef struct SearchWorker {
+    std::string core;
+    const SearchOptions* options;
+    SearchQueue* queue;
+    size_t results = 0;
+} SearchWorker;
+
+void queue_push(SearchQueue& queue, SearchMessage message) {
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.messages.push_back(std::move(message));
+    }
+
+    queue.ready.notify_one();
+}
+
+SearchMessage queue_pop(SearchQueue& queue) {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    queue.ready.wait(lock, [&] { return !queue.messages.empty(); });
+
+    SearchMessage message = std::move(queue.messages.front());
+    queue.messages.pop_front();
+
+    return message;
+}
+
+// Results cross between states as JSON, encoded on the worker's thread.
+int lua_emit_result(lua_State* L) {
+    SearchWorker* worker = (SearchWorker*) lua_touserdata(L, lua_upvalueindex(1));
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    if(!json_encode(L, 1, 0))
+        return lua_error(L);
+
+    size_t size;
+    const char* data = lua_tolstring(L, -1, &size);
+
+    SearchMessage message;
+    message.core = worker->core;
+    message.result.assign(data, size);
+
+    queue_push(*worker->queue, std::move(message));
+    worker->results++;
+
+    return 0;
+}
+
+// Loads the core and calls search(title, emit). Results can be streamed
+// through emit, returned as an array, or both. Pushes an error message and
+// returns false on failure.
+bool run_search(lua_State* L, SearchWorker& worker) {
+    std::string path = worker.options->cores_dir + "/" + worker.core + ".lua";
+
+    if(bytecode_load_file(L, path.c_str()) != LUA_OK || lua_pcall(L, 0, 1, 0) != LUA_OK)
+        return false;
+
+    if(!lua_istable(L, -1)) {
+        lua_pushstring(L, "The core didn't return a table.");
+        return false;
+    }
+
+    lua_getfield(L, -1, "search");
+    if(!lua_isfunction(L, -1)) {
+        lua_pushstring(L, "The core has no search function.");
+        return false;
+    }
+
+    lua_pushstring(L, worker.options->title.c_str());
+    lua_pushlightuserdata(L, &worker);
+    lua_pushcclosure(L, lua_emit_result, 1);
+
+    if(lua_pcall(L, 2, 1, 0) != LUA_OK)
+        return false;
+
+    if(!lua_istable(L, -1))
+        return true;
+
+    int results = lua_gettop(L);
+    lua_Integer count = luaL_len(L, results);
+
+    for(lua_Integer i = 1; i <= count; i++) {
+        lua_pushlightuserdata(L, &worker);
+        lua_pushcclosure(L, lua_emit_result, 1);
+        lua_rawgeti(L, results, i);
+
+        if(lua_pcall(L, 1, 0, 0) != LUA_OK)
+            return false;
+    }
+
+    return true;
+}
+
+void search_worker(SearchWorker* worker) {
+    Clock::time_point start = Clock::now();
+
+    SearchMessage done;
+    done.core = worker->core;
+    done.done = true;
+
+    lua_State* L = worker->options->create_state();
+    if(L == nullptr) {
+        done.error = "Failed to allocate lua state.";
+    } else {
+        if(!run_search(L, *worker)) {
+            const char* error = lua_tostring(L, -1);
+            done.error = error != nullptr ? error : "Unknown error.";
+        }
+
+        lua_close(L);
+    }
+
+    done.results = worker->results;
+    done.time = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    queue_push(*worker->queue, std::move(done));
+}
+
+const char* base32_alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+// Magnets carry the infohash as 40 hex digits or 32 base32 characters;
+// both are turned into lowercase hex so they compare equal.
+std::string normalize_infohash(const std::string& hash) {
+    std::string result;
+
+    if(hash.size() == 32) {
+        static const char* hex = "0123456789abcdef";
+        unsigned int buffer = 0;
+        int bits = 0;
+
+        for(char c : hash) {
+            const char* found = strchr(base32_alphabet, toupper((unsigned char) c));
+            if(found == nullptr || c == '\0')
+                return std::string();
+
+            buffer = buffer << 5 | (found - base32_alphabet);
+            bits += 5;
+
+            while(bits >= 4) {
+                bits -= 4;
+                result += hex[buffer >> bits & 0xF];
+            }
+        }
+
+        return result;
+    }
+
+    for(char c : hash)
+        result += tolower((unsigned char) c);
+
+    return result;
+}
+
+std::string field_string(lua_State* L, int index, const char* field) {
+    std::string value;
+
+    lua_getfield(L, index, field);
+    if(lua_type(L, -1) == LUA_TSTRING)
+        value = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    return value;
+}
+
+double field_number(lua_State* L, int index, const char* field) {
+    lua_getfield(L, index, field);
+    double value = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+    lua_pop(L, 1);
+
+    return value;
+}
+
+// The key results are merged by: the infohash when the result has one or a
+// magnet link, otherwise its title with case and spacing ignored.
+std::string result_key(lua_State* L, int index) {
+    std::string hash = field_string(L, index, "infohash");
+
+    if(hash.empty()) {
+        std::string magnet = field_string(L, index, "magnet");
+        size_t start = magnet.find("btih:");
+
+        if(start != std::string::npos) {
+            start += 5;
+            size_t end = start;
+            while(end < magnet.size() && isalnum((unsigned char) magnet[end]))
+                end++;
+
+            hash = magnet.substr(start, end - start);
+        }
+    }
+
+    hash = normalize_infohash(hash);
+    if(!hash.empty())
+        return "btih:" + hash;
+
+    std::string title = field_string(L, index, "title");
+    std::string key;
+    bool space = false;
+
+    for(char c : title) {
+        if(isspace((unsigned char) c)) {
+            space = !key.empty();
+            continue;
+        }
+
+        if(space)
+            key += ' ';
+        key += tolower((unsigned char) c);
+        space = false;
+    }
+
+    return key.empty() ? key : "title:" + key;
+}
+
+void append_source(lua_State* L, int sources, const char* core) {
+    lua_Integer count = luaL_len(L, sources);
+
+    for(lua_Integer i = 1; i <= count; i++) {
+        lua_rawgeti(L, sources, i);
+        bool found = strcmp(lua_tostring(L, -1), core) == 0;
+        lua_pop(L, 1);
+
+        if(found)
+            return;
+    }
+
+    lua_pushstring(L, core);
+    lua_rawseti(L, sources, count + 1);
+}
+
+// Arguments: the merged array, the key -> position table and the message.
+// A duplicate keeps the copy with the most seeders and lists every core
+// that found it in `sources`.
+int lua_merge_result(lua_State* L) {
+    SearchMessage* message = (SearchMessage*) lua_touserdata(L, 3);
+
+    if(!json_decode(L, message->result.data(), message->result.size()))
+        return lua_error(L);
+    if(!lua_istable(L, -1))
+        return 0;
+
+    int result = lua_gettop(L);
+    const char* core = message->core.c_str();
+
+    lua_pushstring(L, core);
+    lua_setfield(L, result, "core");
+
+    std::string key = result_key(L, result);
+    if(!key.empty()) {
+        lua_pushlstring(L, key.data(), key.size());
+        lua_rawget(L, 2);
+    } else {
+        lua_pushnil(L);
+    }
+
+    if(lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+
+        lua_createtable(L, 1, 0);
+        lua_pushstring(L, core);
+        lua_rawseti(L, -2, 1);
+        lua_setfield(L, result, "sources");
+
+        lua_Integer position = luaL_len(L, 1) + 1;
+        lua_pushvalue(L, result);
+        lua_rawseti(L, 1, position);
+
+        if(!key.empty()) {
+            lua_pushlstring(L, key.data(), key.size());
+            lua_pushinteger(L, position);
+            lua_rawset(L, 2);
+        }
+
+        return 0;
+    }
+
+    lua_Integer position = lua_tointeger(L, -1);
+    lua_rawgeti(L, 1, position);
+    int existing = lua_gettop(L);
+
+    lua_getfield(L, existing, "sources");
+    append_source(L, lua_gettop(L), core);
+
+    if(field_number(L, result, "seeders") > field_number(L, existing, "seeders")) {
+        lua_setfield(L, result, "sources");
+        lua_pushvalue(L, result);
+        lua_rawseti(L, 1, position);
+    }
+
+    return 0;
+}
+
+int lua_compare_results(lua_State* L) {
+    double a = field_number(L, 1, "seeders");
+    double b = field_number(L, 2, "seeders");
+
+    if(a != b) {
+        lua_pushboolean(L, a > b);
+        return 1;
+    }
+
+    lua_pushboolean(L, field_string(L, 1, "title") < field_string(L, 2, "title"));
+    return 1;
+}
+
+void report_error(lua_State* L, const SearchOptions& options, const std::string& core) {
+    const char* error = lua_tostring(L, -1);
+
+    if(options.on_error)
+        options.on_error(core, error != nullptr ? error : "Unknown error.");
+}
+
+// Runs search(title, emit) for every core in its own lua_State on its own
+// thread and merges the results into one array on L as they arrive, so the
+// total time is that of the slowest core. The array is left on the stack,
+// ranked by seeders.
+void search_cores(lua_State* L, const std::vector<std::string>& cores, const SearchOptions& options) {
+    SearchQueue queue;
+    std::vector<SearchWorker> workers(cores.size());
+    std::vector<std::thread> threads;
+
+    for(size_t i = 0; i < cores.size(); i++) {
+        workers[i].core = cores[i];
+        workers[i].options = &options;
+        workers[i].queue = &queue;
+        threads.emplace_back(search_worker, &workers[i]);
+    }
+
+    lua_newtable(L);
+    int merged = lua_gettop(L);
+    lua_newtable(L);
+    int keys = lua_gettop(L);
+
+    size_t remaining = cores.size();
+    while(remaining > 0) {
+        SearchMessage message = queue_pop(queue);
+
+        if(message.done) {
+            remaining--;
+            if(options.on_done)
+                options.on_done(message.core, message.results, message.time, message.error);
+            continue;
+        }
+
+        lua_pushcfunction(L, lua_merge_result);
+        lua_pushvalue(L, merged);
+        lua_pushvalue(L, keys);
+        lua_pushlightuserdata(L, &message);
+
+        if(lua_pcall(L, 3, 0, 0) != LUA_OK) {
+            report_error(L, options, message.core);
+            lua_pop(L, 1);
+        }
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "table");
+    lua_getfield(L, -1, "sort");
+    lua_pushvalue(L, merged);
+    lua_pushcfunction(L, lua_compare_results);
+
+    if(lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        report_error(L, options, std::string());
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+extern "C" {
+    #include <lua.h>
+}
+
+typedef struct SearchOptions {
+    std::string title;
+    std::string cores_dir;
+    std::function<lua_State*()> create_state;
+    std::function<void(const std::string& core, size_t results, double time, const std::string& error)> on_done;
+    // Called when a result can't be merged, or with an empty core when the
+    // results can't be ranked.
+    std::function<void(const std::string& core, const std::string& error)> on_error;
+} SearchOptions;
+
+void search_cores(lua_State* L, const std::vector<std::string>& cores, const SearchOptions& options);
@@ -1,21 +1,30 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 
 #include <json/value.h>
+#include <json/reader.h>
 #include <json/writer.h>
 
 #include "args.h"
 
 #include "lua/request.h"
 #include "lua/json.h"
+#include "lua/config.h"
+#include "lua/bytecode.h"
+#include "lua/cores.h"
+#include "lua/search.h"
 #include "lua/parser.h"
 #include "lua/ui.h"
 
 extern "C" {
-    #include <curl/curl.h>
     #include <lua.h>
     #include <lauxlib.h>
     #include <lualib.h>
@@ -24,8 +33,14 @@ extern "C" {
 
 #define USAGE "ani-download <name> [tags]\n\n" \
               "Flags:\n" \
-              "\t-c, --core:\tWhich core to use.\n" \
-              "\t-l, --list-cores:\tLists all of the available cores.\n"
+              "\t-c, --core:\tWhich core to use. A comma separated list searches all of them at once.\n" \
+              "\t-ac, --all-cores:\tSearches every core that supports searching at once.\n" \
+              "\t-l, --list-cores:\tLists all of the available cores.\n" \
+              "\t-ns, --net-stats:\tPrints per host network statistics on exit.\n" \
+              "\t-rec, --record:\tRecords every response to the given cassette file.\n" \
+              "\t-rep, --replay:\tAnswers requests from the given cassette file instead of the network.\n" \
+              "\t-u, --upstream:\tSends every request to the given base URL, e.g. a replay-server.\n" \
+              "\t-ps, --profile-startup:\tPrints how long each startup phase took before the core's download function is called.\n"
 
 std::string home_dir = getenv("HOME");
 std::string config_dir = home_dir + "/.config/ani-downloader";
@@ -37,13 +52,65 @@ std::string settings_path = config_dir + "/settings.json";
 typedef struct Flags {
     std::string name;
     std::string core;
+    bool all_cores;
+    bool net_stats;
+    std::string record;
+    std::string replay;
+    std::string upstream;
+    bool profile_startup;
 } Flags;
 
 Flags flags = {
     .name = std::string(),
     .core = std::string(),
+    .all_cores = false,
+    .net_stats = false,
+    .record = std::string(),
+    .replay = std::string(),
+    .upstream = std::string(),
+    .profile_startup = false,
 };
 
+typedef std::chrono::steady_clock Clock;
+
+typedef struct StartupPhase {
+    std::string name;
+    double time;
+} StartupPhase;
+
+// Starts counting during static initialization, the closest we get to the
+// process start without asking the OS.
+Clock::time_point startup_time = Clock::now();
+Clock::time_point phase_time = startup_time;
+std::vector<StartupPhase> startup_phases;
+std::vector<StartupPhase> library_phases;
+std::mutex library_phases_mutex;
+
+double elapsed_ms(Clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+void end_phase(const char* name) {
+    startup_phases.push_back({name, elapsed_ms(phase_time)});
+    phase_time = Clock::now();
+}
+
+void print_startup_profile(FILE* file) {
+    fprintf(file, "Startup profile:\n");
+    for(const StartupPhase& phase : startup_phases)
+        fprintf(file, "  %-24s %8.3f ms\n", phase.name.c_str(), phase.time);
+
+    fprintf(file, "  %-24s %8.3f ms\n", "total", elapsed_ms(startup_time));
+
+    std::lock_guard<std::mutex> lock(library_phases_mutex);
+    if(library_phases.empty())
+        return;
+
+    fprintf(file, "Libraries loaded on first use (included above):\n");
+    for(const StartupPhase& phase : library_phases)
+        fprintf(file, "  %-24s %8.3f ms\n", phase.name.c_str(), phase.time);
+}
+
 void help_func(char*) {
     printf("%s", USAGE);
 }
@@ -55,22 +122,75 @@ void core_func(char* core) {
     flags.core = core;
 }
 
+void all_cores_func(char*) {
+    flags.all_cores = true;
+}
+
+void net_stats_func(char*) {
+    flags.net_stats = true;
+}
+
+void record_func(char* path) {
+    if(path == nullptr)
+        return;
+
+    flags.record = path;
+}
+
+void replay_func(char* path) {
+    if(path == nullptr)
+        return;
+
+    flags.replay = path;
+}
+
+void upstream_func(char* url) {
+    if(url == nullptr)
+        return;
+
+    flags.upstream = url;
+}
+
+void profile_startup_func(char*) {
+    flags.profile_startup = true;
+}
+
 void list_cores_func(char*) {
-    for(const auto& entry : std::filesystem::directory_iterator(cores_dir)) {
-        std::filesystem::path path = entry.path();
-        if(path.extension().compare(".lua") != 0)
-            continue;
+    std::vector<CoreInfo> cores;
+    if(!cores_list(cores_dir, config_dir + "/cores.index", cores)) {
+        fprintf(stderr, "Failed to read the cores directory: %s\n", cores_dir.c_str());
+        exit(EXIT_FAILURE);
+    }
 
-        const char* dir_name = path.filename().replace_extension("").c_str();
-        if(dir_name[0] == '.')
-            continue;
+    int name_width = 4;
+    int version_width = 7;
+    int type_width = 4;
 
-        printf("%s\n", dir_name);
+    for(const CoreInfo& core : cores) {
+        name_width = std::max(name_width, (int) core.name.size());
+        version_width = std::max(version_width, (int) core.version.size());
+        type_width = std::max(type_width, (int) core.type.size());
     }
+
+    printf("%-*s  %-*s  %-*s  %s\n", name_width, "Name", version_width, "Version", type_width, "Type", "Description");
+
+    for(const CoreInfo& core : cores) {
+        const std::string& description = core.error.empty() ? core.description : "Failed to load: " + core.error;
+
+        printf("%-*s  %-*s  %-*s  %s\n",
+            name_width, core.name.c_str(),
+            version_width, core.version.c_str(),
+            type_width, core.type.c_str(),
+            description.c_str());
+    }
+
+    exit(EXIT_SUCCESS);
 }
 
 int load_core(lua_State*L, std::string core) {
-    if (luaL_dofile(L, (cores_dir + "/" + core + ".lua").c_str()) != LUA_OK) {
+    std::string path = cores_dir + "/" + core + ".lua";
+
+    if (bytecode_load_file(L, path.c_str()) != LUA_OK || lua_pcall(L, 0, LUA_MULTRET, 0) != LUA_OK) {
         const char* error = lua_tostring(L, -1);
         printf("Error loading core: %s\n", error);
         lua_pop(L, 1);
@@ -82,9 +202,14 @@ int load_core(lua_State*L, std::string core) {
 
 int call_core(lua_State* L) {
     load_core(L, flags.core);
-    
+    end_phase("load core");
+
     if (lua_istable(L, -1)) {
         lua_getfield(L, -1, "download");
+
+        if(flags.profile_startup)
+            print_startup_profile(stderr);
+
         lua_pushstring(L, flags.name.c_str());
         if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
             const char* error = lua_tostring(L, -1);
@@ -124,6 +249,91 @@ void load_system_paths(lua_State* L) {
     lua_setglobal(L, "system_paths");
 }
 
+typedef struct Library {
+    const char* name;
+    void (*load)(lua_State* L);
+} Library;
+
+const Library libraries[] = {
+    {"json", load_json_library},
+    {"configs", load_config_library},
+    {"requests", load_request_library},
+    {"html", load_html_library},
+    {"ui", load_ui_library},
+};
+
+const Library* find_library(const char* name) {
+    for(const Library& library : libraries) {
+        if(strcmp(library.name, name) == 0)
+            return &library;
+    }
+
+    return nullptr;
+}
+
+// Loads a library into its global and leaves the global on the stack. The
+// global is read raw, since a missing one would land back in lua_global_index.
+void push_library(lua_State* L, const Library* library) {
+    lua_pushglobaltable(L);
+    lua_pushstring(L, library->name);
+    lua_rawget(L, -2);
+
+    if(lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+
+        Clock::time_point start = Clock::now();
+        library->load(L);
+
+        {
+            std::lock_guard<std::mutex> lock(library_phases_mutex);
+            library_phases.push_back({library->name, elapsed_ms(start)});
+        }
+
+        lua_pushstring(L, library->name);
+        lua_rawget(L, -2);
+    }
+
+    lua_remove(L, -2);
+}
+
+int lua_require_library(lua_State* L) {
+    push_library(L, (const Library*) lua_touserdata(L, lua_upvalueindex(1)));
+    return 1;
+}
+
+int lua_global_index(lua_State* L) {
+    const Library* library = lua_type(L, 2) == LUA_TSTRING ? find_library(lua_tostring(L, 2)) : nullptr;
+
+    if(library == nullptr)
+        lua_pushnil(L);
+    else
+        push_library(L, library);
+
+    return 1;
+}
+
+// The native libraries are only loaded the first time a script reads their
+// global or requires them, through a __index on _G and package.preload.
+void register_libraries(lua_State* L) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+
+    for(const Library& library : libraries) {
+        lua_pushlightuserdata(L, (void*) &library);
+        lua_pushcclosure(L, lua_require_library, 1);
+        lua_setfield(L, -2, library.name);
+    }
+
+    lua_pop(L, 2);
+
+    lua_pushglobaltable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lua_global_index);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+}
+
 void set_settings(Json::Value settings) {
     std::ofstream file(settings_path);
     Json::StreamWriterBuilder writer;
@@ -161,6 +371,149 @@ void add_package_path(lua_State*L, std::string dir) {
     lua_pop(L, 1);
 }
 
+// Every core runs in its own state, so a multi-core search calls this once
+// per worker thread.
+lua_State* create_state() {
+    lua_State* L = luaL_newstate();
+    if(L == nullptr)
+        return nullptr;
+
+    luaL_openlibs(L);
+    register_libraries(L);
+    load_system_paths(L);
+
+    add_package_path(L, modules_dir);
+    bytecode_add_searcher(L);
+
+    return L;
+}
+
+std::vector<std::string> split_cores(const std::string& list) {
+    std::vector<std::string> cores;
+    size_t start = 0;
+
+    while(start <= list.size()) {
+        size_t end = list.find(',', start);
+        if(end == std::string::npos)
+            end = list.size();
+
+        std::string core = list.substr(start, end - start);
+        if(!core.empty() && std::find(cores.begin(), cores.end(), core) == cores.end())
+            cores.push_back(core);
+
+        start = end + 1;
+    }
+
+    return cores;
+}
+
+void print_result(lua_State* L, int index, int number) {
+    lua_getfield(L, index, "seeders");
+    lua_Integer seeders = lua_tointeger(L, -1);
+    lua_getfield(L, index, "title");
+    const char* title = lua_tostring(L, -1);
+    lua_getfield(L, index, "size");
+    const char* size = lua_tostring(L, -1);
+    lua_pop(L, 3);
+
+    std::string sources;
+    lua_getfield(L, index, "sources");
+    lua_Integer count = lua_istable(L, -1) ? luaL_len(L, -1) : 0;
+
+    for(lua_Integer i = 1; i <= count; i++) {
+        lua_rawgeti(L, -1, i);
+        sources += (i > 1 ? "," : "") + std::string(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    printf("%3d. [%5lld] %s", number, (long long) seeders, title != nullptr ? title : "(untitled)");
+    if(size != nullptr)
+        printf(" (%s)", size);
+    printf(" <%s>\n", sources.c_str());
+}
+
+// Searches every core at once, lists the merged results and hands the
+// chosen one to the download_result function of the core that found it.
+int call_cores(lua_State* L, const std::vector<std::string>& cores) {
+    SearchOptions options;
+    options.title = flags.name;
+    options.cores_dir = cores_dir;
+    options.create_state = create_state;
+    options.on_done = [](const std::string& core, size_t results, double time, const std::string& error) {
+        if(error.empty())
+            printf("%s: %zu results in %.0f ms\n", core.c_str(), results, time);
+        else
+            printf("%s: failed after %.0f ms: %s\n", core.c_str(), time, error.c_str());
+    };
+    options.on_error = [](const std::string& core, const std::string& error) {
+        if(core.empty())
+            printf("Failed to rank the results: %s\n", error.c_str());
+        else
+            printf("%s: failed to merge a result: %s\n", core.c_str(), error.c_str());
+    };
+
+    if(flags.profile_startup)
+        print_startup_profile(stderr);
+
+    printf("Searching %zu cores for %s..\n", cores.size(), flags.name.c_str());
+    search_cores(L, cores, options);
+
+    int results = lua_gettop(L);
+    lua_Integer count = luaL_len(L, results);
+
+    if(count == 0) {
+        printf("No results.\n");
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    for(lua_Integer i = 1; i <= count; i++) {
+        lua_rawgeti(L, results, i);
+        print_result(L, lua_gettop(L), i);
+        lua_pop(L, 1);
+    }
+
+    printf("Download which result? ");
+    fflush(stdout);
+
+    char line[32];
+    long choice = fgets(line, sizeof(line), stdin) != nullptr ? strtol(line, nullptr, 10) : 0;
+
+    if(choice < 1 || choice > count) {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    lua_rawgeti(L, results, choice);
+    lua_getfield(L, -1, "core");
+    std::string core = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    if(!load_core(L, core)) {
+        lua_pop(L, 2);
+        return 0;
+    }
+
+    if(!lua_istable(L, -1)) {
+        printf("Error: Returned value is not a table.\n");
+        lua_pop(L, 3);
+        return 0;
+    }
+
+    lua_getfield(L, -1, "download_result");
+    lua_pushvalue(L, -3);
+
+    if(lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        printf("Error calling download_result function: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 4);
+        return 0;
+    }
+
+    lua_pop(L, 3);
+    return 1;
+}
+
 int main(int argc, char** argv) {
     if(!std::filesystem::is_directory(config_dir)) {
         std::filesystem::create_directory(config_dir);
@@ -174,28 +527,45 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    lua_State* L = luaL_newstate();
-    if(L == nullptr) {
-        curl_global_cleanup();
-        fprintf(stderr, "Failed to allocate lua state.");
-        return EXIT_FAILURE;
-    }
+    if(*argv[1] != '-')
+        flags.name = argv[1];
 
-    luaL_openlibs(L);
-    load_json_library(L);
-    load_request_library(L);
-    load_html_library(L);
-    load_system_paths(L);
-    load_ui_library(L); 
+    bytecode_set_dir(config_dir + "/bytecode");
 
-    add_package_path(L, modules_dir);
+    FlagContainer* container = create_container();
+    add_flag(container, "help", help_func, "h");
+    add_flag(container, "core", core_func, nullptr);
+    add_flag(container, "all-cores", all_cores_func, "ac");
+    add_flag(container, "list-cores", list_cores_func, "l");
+    add_flag(container, "net-stats", net_stats_func, nullptr);
+    add_flag(container, "record", record_func, "rec");
+    add_flag(container, "replay", replay_func, "rep");
+    add_flag(container, "upstream", upstream_func, "u");
+    add_flag(container, "profile-startup", profile_startup_func, "ps");
+    handle_args(container, argc, argv, 1);
+    end_phase("arguments");
 
-    if(*argv[0] != '-')
-        flags.name = argv[1];
+    std::vector<std::string> cores;
 
-    if(argc == 2 && !flags.name.empty()) {
-        flags.name = argv[1];
+    if(flags.all_cores) {
+        std::vector<CoreInfo> available;
+        cores_list(cores_dir, config_dir + "/cores.index", available);
+
+        for(const CoreInfo& core : available) {
+            if(core.searchable)
+                cores.push_back(core.file);
+        }
+
+        if(cores.empty()) {
+            fprintf(stderr, "No cores support searching.\n");
+            return EXIT_FAILURE;
+        }
+
+        flags.core = cores[0];
+        end_phase("cores");
+    }
+
+    if(flags.core.empty() && !flags.name.empty()) {
         Json::Value settings = get_settings();
 
         if(!settings.isMember("default_core")) {
@@ -204,14 +574,45 @@ int main(int argc, char** argv) {
         }
 
         flags.core = settings["default_core"].asString();
+        end_phase("settings");
     }
 
-    FlagContainer* container = create_container();
-    add_flag(container, "core", core_func, nullptr);
-    add_flag(container, "list-cores", list_cores_func, "l");
-    handle_args(container, argc, argv, 1);
+    if(!flags.replay.empty() && !set_request_replay(flags.replay)) {
+        fprintf(stderr, "Failed to load cassette: %s\n", flags.replay.c_str());
+        flags.core.clear();
+    }
+
+    if(flags.core.empty())
+        return EXIT_SUCCESS;
+
+    if(!flags.all_cores) {
+        cores = split_cores(flags.core);
+        if(cores.empty())
+            return EXIT_SUCCESS;
+
+        flags.core = cores[0];
+    }
+
+    set_request_cache_dir(config_dir + "/cache");
+    set_request_cookie_dir(config_dir + "/cookies");
 
-    if(!flags.core.empty())
+    lua_State* L = create_state();
+    if(L == nullptr) {
+        fprintf(stderr, "Failed to allocate lua state.");
+        return EXIT_FAILURE;
+    }
+
+    if(!flags.record.empty())
+        set_request_record(flags.record);
+
+    if(!flags.upstream.empty())
+        set_request_upstream(flags.upstream);
+
+    end_phase("lua state");
+
+    if(cores.size() > 1 || flags.all_cores)
+        call_cores(L, cores);
+    else
         call_core(L);
 
     if (stdscr) {
@@ -221,8 +622,12 @@ int main(int argc, char** argv) {
 
         endwin();
     }
+
+    if(flags.net_stats)
+        print_request_stats(stderr);
+
     lua_close(L);
-    curl_global_cleanup();
+    unload_request_library();
     exit(EXIT_SUCCESS);
 
     return EXIT_FAILURE;
@@ -0,0 +1,305 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "args.h"
+#include "lua/cassette.h"
+
+#define USAGE "replay-server <cassette> [flags]\n\n" \
+              "Serves the responses recorded with --record over HTTP.\n\n" \
+              "Flags:\n" \
+              "\t-p, --port:\tThe port to listen on. Defaults to 8089.\n" \
+              "\t-l, --latency:\tMilliseconds to wait before answering each request.\n" \
+              "\t-b, --bandwidth:\tMaximum bytes per second sent per connection.\n"
+
+typedef struct Options {
+    int port;
+    long latency;
+    long bandwidth;
+} Options;
+
+Options options = {
+    .port = 8089,
+    .latency = 0,
+    .bandwidth = 0,
+};
+
+std::vector<CassetteEntry> entries;
+std::unordered_map<std::string, std::vector<size_t>> index_by_body;
+std::unordered_map<std::string, std::vector<size_t>> index_by_path;
+std::unordered_map<std::string, size_t> cursors;
+std::mutex cursors_mutex;
+
+void help_func(char*) {
+    printf("%s", USAGE);
+    exit(EXIT_SUCCESS);
+}
+
+void port_func(char* port) {
+    if(port != nullptr)
+        options.port = atoi(port);
+}
+
+void latency_func(char* latency) {
+    if(latency != nullptr)
+        options.latency = atol(latency);
+}
+
+void bandwidth_func(char* bandwidth) {
+    if(bandwidth != nullptr)
+        options.bandwidth = atol(bandwidth);
+}
+
+std::string url_target(const std::string& url) {
+    size_t scheme = url.find("://");
+    size_t path = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+
+    return path == std::string::npos ? "/" : url.substr(path);
+}
+
+std::string request_target(const std::string& target) {
+    if(target.compare(0, 4, "http") == 0)
+        return url_target(target);
+
+    return target;
+}
+
+const CassetteEntry* find_entry(const std::string& method, const std::string& target, const std::string& body) {
+    std::string path_key = method + " " + target;
+    std::string body_key = path_key + " " + cassette_hash(body.data(), body.size());
+
+    auto found = index_by_body.find(body_key);
+    std::string key = body_key;
+
+    if(found == index_by_body.end()) {
+        found = index_by_path.find(path_key);
+        key = path_key;
+
+        if(found == index_by_path.end())
+            return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cursors_mutex);
+    size_t& cursor = cursors[key];
+    const CassetteEntry* entry = &entries[found->second[cursor]];
+    if(cursor + 1 < found->second.size())
+        cursor++;
+
+    return entry;
+}
+
+std::string response_head(const CassetteEntry& entry) {
+    const std::string& data = entry.header_data;
+    size_t start = 0;
+    size_t block = 0;
+
+    while(start < data.size()) {
+        if(data.compare(start, 5, "HTTP/") == 0)
+            block = start;
+
+        start = data.find('\n', start);
+        if(start == std::string::npos)
+            break;
+        start++;
+    }
+
+    std::string head;
+    start = block;
+
+    while(start < data.size()) {
+        size_t end = data.find('\n', start);
+        if(end == std::string::npos)
+            end = data.size();
+
+        std::string line = data.substr(start, end - start);
+        while(!line.empty() && (line.back() == '\r' || line.back() == ' '))
+            line.pop_back();
+
+        start = end + 1;
+        if(line.empty())
+            continue;
+
+        if(strncasecmp(line.c_str(), "Content-Length:", 15) == 0
+        || strncasecmp(line.c_str(), "Transfer-Encoding:", 18) == 0
+        || strncasecmp(line.c_str(), "Content-Encoding:", 17) == 0
+        || strncasecmp(line.c_str(), "Connection:", 11) == 0)
+            continue;
+
+        head += line + "\r\n";
+    }
+
+    head += "Content-Length: " + std::to_string(entry.body.size()) + "\r\n";
+    head += "Connection: keep-alive\r\n\r\n";
+
+    return head;
+}
+
+bool send_all(int client, const char* data, size_t size) {
+    while(size > 0) {
+        size_t chunk = size;
+
+        if(options.bandwidth > 0) {
+            size_t limit = options.bandwidth / 20 > 0 ? options.bandwidth / 20 : 1;
+            if(chunk > limit)
+                chunk = limit;
+        }
+
+        ssize_t sent = send(client, data, chunk, MSG_NOSIGNAL);
+        if(sent <= 0)
+            return false;
+
+        data += sent;
+        size -= sent;
+
+        if(options.bandwidth > 0 && size > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(sent * 1000000L / options.bandwidth));
+    }
+
+    return true;
+}
+
+void serve_client(int client) {
+    std::string buffer;
+    char chunk[16384];
+
+    while(true) {
+        size_t head_end;
+        while((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+            if(received <= 0) {
+                close(client);
+                return;
+            }
+            buffer.append(chunk, received);
+        }
+
+        std::string head = buffer.substr(0, head_end);
+        buffer.erase(0, head_end + 4);
+
+        char method[16] = {0};
+        char target[8192] = {0};
+        sscanf(head.c_str(), "%15s %8191s", method, target);
+
+        size_t content_length = 0;
+        bool keep_alive = true;
+        size_t line = head.find("\r\n");
+
+        while(line != std::string::npos) {
+            const char* header = head.c_str() + line + 2;
+
+            if(strncasecmp(header, "Content-Length:", 15) == 0)
+                content_length = strtoul(header + 15, nullptr, 10);
+            else if(strncasecmp(header, "Connection:", 11) == 0 && strcasestr(header, "close") != nullptr)
+                keep_alive = false;
+
+            line = head.find("\r\n", line + 2);
+        }
+
+        while(buffer.size() < content_length) {
+            ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+            if(received <= 0) {
+                close(client);
+                return;
+            }
+            buffer.append(chunk, received);
+        }
+
+        std::string body = buffer.substr(0, content_length);
+        buffer.erase(0, content_length);
+
+        if(options.latency > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.latency));
+
+        const CassetteEntry* entry = find_entry(method, request_target(target), body);
+        bool ok;
+
+        if(entry == nullptr) {
+            fprintf(stderr, "No recorded response for %s %s\n", method, target);
+
+            const char* missing = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+            ok = send_all(client, missing, strlen(missing));
+        } else {
+            std::string response = response_head(*entry);
+            ok = send_all(client, response.data(), response.size())
+              && send_all(client, entry->body.data(), entry->body.size());
+        }
+
+        if(!ok || !keep_alive)
+            break;
+    }
+
+    close(client);
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2 || argv[1][0] == '-') {
+        printf("%s", USAGE);
+        return EXIT_FAILURE;
+    }
+
+    FlagContainer* container = create_container();
+    add_flag(container, "help", help_func, nullptr);
+    add_flag(container, "port", port_func, nullptr);
+    add_flag(container, "latency", latency_func, nullptr);
+    add_flag(container, "bandwidth", bandwidth_func, nullptr);
+    handle_args(container, argc, argv, 1);
+
+    if(!cassette_load(argv[1], entries)) {
+        fprintf(stderr, "Failed to load cassette: %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    for(size_t i = 0; i < entries.size(); i++) {
+        const CassetteEntry& entry = entries[i];
+        std::string path_key = entry.method + " " + url_target(entry.url);
+
+        index_by_path[path_key].push_back(i);
+        index_by_body[path_key + " " + entry.body_hash].push_back(i);
+    }
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if(server < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.port);
+
+    if(bind(server, (sockaddr*) &address, sizeof(address)) != 0 || listen(server, 64) != 0) {
+        perror("bind");
+        close(server);
+        return EXIT_FAILURE;
+    }
+
+    printf("Serving %zu recorded responses on http://127.0.0.1:%d\n", entries.size(), options.port);
+    fflush(stdout);
+
+    while(true) {
+        int client = accept(server, nullptr, nullptr);
+        if(client < 0)
+            continue;
+
+        std::thread(serve_client, client).detach();
+    }
+
+    close(server);
+    return EXIT_SUCCESS;
+}